@@ -0,0 +1,246 @@
+#include "bench.h"
+#include "util/pool.h"
+#include "util/concurrentpool.h"
+#include "util/arena.h"
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <cstdlib>
+
+// about the size of a small component
+struct Object {
+    float pos[3];
+    float vel[3];
+    int id;
+    Object *next;
+
+    Object() : id(0), next(nullptr) {
+        for (int i = 0; i < 3; ++i)
+            pos[i] = vel[i] = 0;
+    }
+};
+
+enum {
+    LIVE_OBJECTS = 1 << 14,
+    CHURN = 1 << 20
+};
+
+// frees and creates objects in random order, with the pool staying at
+// around LIVE_OBJECTS
+template <class Create, class Destroy>
+static void churn(Bench &b, Create create, Destroy destroy) {
+    BenchRandom rnd;
+    std::vector<Object *> live(LIVE_OBJECTS);
+    for (int i = 0; i < LIVE_OBJECTS; ++i)
+        live[i] = create();
+    b.time([&]() {
+        for (int i = 0; i < b.ops; ++i) {
+            Object *&o = live[rnd.next() & (LIVE_OBJECTS - 1)];
+            destroy(o);
+            o = create();
+        }
+    });
+    for (Object *o : live)
+        destroy(o);
+}
+
+BENCHMARK(Pool, create_free, "Pool<T>", CHURN) {
+    Pool<Object> pool;
+    churn(b, [&]() { return pool.create(); }, [&](Object *o) { pool.free(o); });
+}
+
+BENCHMARK(Pool, create_free, "IterablePool<T>", CHURN) {
+    IterablePool<Object> pool;
+    churn(b, [&]() { return pool.create(); }, [&](Object *o) { pool.free(o); });
+}
+
+BENCHMARK(Pool, create_free, "new/delete", CHURN) {
+    churn(b, []() { return new Object; }, [](Object *o) { delete o; });
+}
+
+// a quarter of the objects freed at random, as pools get after a while
+static std::vector<int> holes() {
+    BenchRandom rnd;
+    std::vector<int> freed;
+    for (int i = 0; i < LIVE_OBJECTS; ++i)
+    if ((rnd.next() & 3) == 0)
+        freed.push_back(i);
+    return freed;
+}
+
+BENCHMARK(Pool, iterate, "IterablePool<T>", LIVE_OBJECTS * 64) {
+    IterablePool<Object> pool;
+    std::vector<Object *> objs;
+    for (int i = 0; i < LIVE_OBJECTS; ++i)
+        objs.push_back(pool.create());
+    for (int i : holes())
+        pool.free(objs[i]);
+    b.time([&]() {
+        float sum = 0;
+        for (int r = 0; r < b.ops / LIVE_OBJECTS; ++r)
+        for (Object *o : pool)
+            sum += o->vel[0];
+        bench_use((uint64_t)sum);
+    });
+}
+
+BENCHMARK(Pool, iterate, "IterablePool<T> spans", LIVE_OBJECTS * 64) {
+    IterablePool<Object> pool;
+    std::vector<Object *> objs;
+    for (int i = 0; i < LIVE_OBJECTS; ++i)
+        objs.push_back(pool.create());
+    for (int i : holes())
+        pool.free(objs[i]);
+    b.time([&]() {
+        float sum = 0;
+        for (int r = 0; r < b.ops / LIVE_OBJECTS; ++r) {
+            pool.for_each_span([&](Object *o, int n) {
+                for (int i = 0; i < n; ++i)
+                    sum += o[i].vel[0];
+            });
+        }
+        bench_use((uint64_t)sum);
+    });
+}
+
+BENCHMARK(Pool, iterate, "std::vector<T *>", LIVE_OBJECTS * 64) {
+    std::vector<std::unique_ptr<Object> > owned;
+    for (int i = 0; i < LIVE_OBJECTS; ++i)
+        owned.push_back(std::unique_ptr<Object>(new Object));
+    std::vector<Object *> objs;
+    std::vector<int> freed = holes();
+    size_t k = 0;
+    for (int i = 0; i < LIVE_OBJECTS; ++i) {
+        if (k < freed.size() && freed[k] == i)
+            ++k;
+        else
+            objs.push_back(owned[i].get());
+    }
+    b.time([&]() {
+        float sum = 0;
+        for (int r = 0; r < b.ops / LIVE_OBJECTS; ++r)
+        for (Object *o : objs)
+            sum += o->vel[0];
+        bench_use((uint64_t)sum);
+    });
+}
+
+
+// every thread creates a batch of objects, then frees the batch its
+// neighbor created, as when entities are spawned by one system and
+// destroyed by another. the ids are checked on the way
+
+enum {
+    POOL_THREADS = 4,
+    HANDOFF = 1 << 12
+};
+
+template <class Create, class Destroy>
+static void cross_thread(Bench &b, Create create, Destroy destroy) {
+    std::vector<Object *> handoff(POOL_THREADS * HANDOFF);
+    std::atomic<int> bad(0);
+    BenchBarrier barrier(POOL_THREADS);
+    b.time([&]() {
+        bench_threads(POOL_THREADS, [&](int t) {
+            Object **mine = &handoff[t * HANDOFF];
+            int next = (t + 1) % POOL_THREADS;
+            Object **theirs = &handoff[next * HANDOFF];
+            for (int r = 0; r < b.ops / (POOL_THREADS * HANDOFF); ++r) {
+                for (int i = 0; i < HANDOFF; ++i) {
+                    mine[i] = create();
+                    mine[i]->id = t * HANDOFF + i;
+                }
+                barrier.wait();
+                for (int i = 0; i < HANDOFF; ++i) {
+                    if (theirs[i]->id != next * HANDOFF + i)
+                        ++bad;
+                    destroy(theirs[i]);
+                }
+                barrier.wait();
+            }
+        });
+    });
+    bench_check(!bad, "objects handed between threads were intact");
+}
+
+BENCHMARK(ConcurrentPool, cross_thread, "ConcurrentPool<T>", POOL_THREADS * HANDOFF * 16) {
+    ConcurrentPool<Object> pool;
+    cross_thread(b, [&]() { return pool.create(); }, [&](Object *o) { pool.free(o); });
+    ConcurrentPool<Object>::Stats s = pool.stats();
+    bench_check(s.live == 0 && s.creates == (unsigned int)b.ops && s.frees == (unsigned int)b.ops,
+                "ConcurrentPool counts every create and free");
+    pool.compact([](Object *, Object *) {});
+    bench_check(pool.stats().blocks == 0, "ConcurrentPool compacts to nothing when empty");
+}
+
+BENCHMARK(ConcurrentPool, cross_thread, "IterablePool<T> + mutex", POOL_THREADS * HANDOFF * 16) {
+    IterablePool<Object> pool;
+    std::mutex mutex;
+    cross_thread(b,
+        [&]() { std::lock_guard<std::mutex> lock(mutex); return pool.create(); },
+        [&](Object *o) { std::lock_guard<std::mutex> lock(mutex); pool.free(o); });
+    bench_check(pool.size() == 0, "IterablePool is empty");
+}
+
+BENCHMARK(ConcurrentPool, cross_thread, "new/delete", POOL_THREADS * HANDOFF * 16) {
+    cross_thread(b, []() { return new Object; }, [](Object *o) { delete o; });
+}
+
+
+// many small allocations, all freed at once, as for a frame's temporaries
+
+enum {
+    FRAME_ALLOCS = 1 << 12,
+    FRAMES = 256
+};
+
+static int alloc_size(BenchRandom &rnd) {
+    return 8 + (rnd.next() & 63);
+}
+
+BENCHMARK(Arena, alloc_rewind, "Arena", FRAME_ALLOCS * FRAMES) {
+    BenchRandom rnd;
+    std::vector<int> sizes(FRAME_ALLOCS);
+    for (int &s : sizes)
+        s = alloc_size(rnd);
+    Arena arena;
+    b.time([&]() {
+        for (int f = 0; f < b.ops / FRAME_ALLOCS; ++f) {
+            for (int i = 0; i < FRAME_ALLOCS; ++i)
+                bench_use_ptr(arena.alloc_aligned(sizes[i], 8));
+            arena.rewind();
+        }
+    });
+}
+
+BENCHMARK(Arena, alloc_rewind, "Arena clear", FRAME_ALLOCS * FRAMES) {
+    BenchRandom rnd;
+    std::vector<int> sizes(FRAME_ALLOCS);
+    for (int &s : sizes)
+        s = alloc_size(rnd);
+    Arena arena;
+    b.time([&]() {
+        for (int f = 0; f < b.ops / FRAME_ALLOCS; ++f) {
+            for (int i = 0; i < FRAME_ALLOCS; ++i)
+                bench_use_ptr(arena.alloc_aligned(sizes[i], 8));
+            arena.clear();
+        }
+    });
+}
+
+BENCHMARK(Arena, alloc_rewind, "malloc/free", FRAME_ALLOCS * FRAMES) {
+    BenchRandom rnd;
+    std::vector<int> sizes(FRAME_ALLOCS);
+    for (int &s : sizes)
+        s = alloc_size(rnd);
+    std::vector<void *> ptrs(FRAME_ALLOCS);
+    b.time([&]() {
+        for (int f = 0; f < b.ops / FRAME_ALLOCS; ++f) {
+            for (int i = 0; i < FRAME_ALLOCS; ++i)
+                bench_use_ptr(ptrs[i] = malloc(sizes[i]));
+            for (int i = 0; i < FRAME_ALLOCS; ++i)
+                free(ptrs[i]);
+        }
+    });
+}
@@ -0,0 +1,137 @@
+#include "bench.h"
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Runs the benchmarks whose "group/name/impl" contains the first argument,
+// or all of them, and prints the results as JSON on stdout:
+//
+//     {"benchmarks": [
+//       {"group": "Arena", "name": "alloc", "impl": "Arena", "ops": 1048576,
+//        "runs": 7, "ns_per_op_min": 1.2, "ns_per_op_median": 1.3},
+//       ...
+//     ]}
+//
+// Progress goes to stderr, so the output can be redirected to a file and
+// compared with one from before a change.
+
+enum { RUNS = 7 };
+
+std::vector<BenchInfo> &benchmarks() {
+    static std::vector<BenchInfo> list;
+    return list;
+}
+
+static volatile uint64_t sink;
+
+void bench_use(uint64_t x) {
+    sink = sink + x;
+}
+
+void bench_check(bool ok, const char *what) {
+    if (ok)
+        return;
+    fprintf(stderr, "check failed: %s\n", what);
+    _Exit(1); // also from a bench thread, which exit() would try to join
+}
+
+namespace {
+    class BenchThreads {
+    public:
+        BenchThreads() : func(nullptr), count(0), running(0), generation(0), quit(false) {}
+
+        ~BenchThreads() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                quit = true;
+            }
+            start.notify_all();
+            for (std::thread &t : threads)
+                t.join();
+        }
+
+        void run(int n, const std::function<void(int)> &f) {
+            std::unique_lock<std::mutex> lock(mutex);
+            while ((int)threads.size() < n) {
+                int index = (int)threads.size();
+                unsigned int gen = generation;
+                threads.push_back(std::thread([this, index, gen]() { worker(index, gen); }));
+            }
+            func = &f;
+            count = n;
+            running = n;
+            ++generation;
+            start.notify_all();
+            while (running)
+                done.wait(lock);
+            func = nullptr;
+        }
+
+    private:
+        void worker(int index, unsigned int seen) {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (;;) {
+                while (generation == seen && !quit)
+                    start.wait(lock);
+                if (quit)
+                    return;
+                seen = generation;
+                if (index >= count)
+                    continue;
+                const std::function<void(int)> *f = func;
+                lock.unlock();
+                (*f)(index);
+                lock.lock();
+                if (--running == 0)
+                    done.notify_one();
+            }
+        }
+
+        std::vector<std::thread> threads;
+        const std::function<void(int)> *func;
+        int count; // threads taking part in this run
+        int running;
+        unsigned int generation; // bumped for each run
+        bool quit;
+        std::mutex mutex;
+        std::condition_variable start;
+        std::condition_variable done;
+    };
+}
+
+void bench_threads(int n, const std::function<void(int)> &func) {
+    static BenchThreads threads;
+    threads.run(n, func);
+}
+
+int main(int argc, char **argv) {
+    const char *filter = argc > 1 ? argv[1] : "";
+
+    printf("{\"benchmarks\": [\n");
+    bool first = true;
+    for (const BenchInfo &info : benchmarks()) {
+        std::string id = std::string(info.group) + "/" + info.name + "/" + info.impl;
+        if (!strstr(id.c_str(), filter))
+            continue;
+        fprintf(stderr, "%s\n", id.c_str());
+
+        double ns[RUNS];
+        for (int i = 0; i < RUNS; ++i) {
+            Bench b(info.ops);
+            info.func(b);
+            ns[i] = b.nanoseconds() / info.ops;
+        }
+        std::sort(ns, ns + RUNS);
+
+        printf("%s  {\"group\": \"%s\", \"name\": \"%s\", \"impl\": \"%s\", \"ops\": %d, "
+               "\"runs\": %d, \"ns_per_op_min\": %.3f, \"ns_per_op_median\": %.3f}",
+               first ? "" : ",\n", info.group, info.name, info.impl, info.ops,
+               (int)RUNS, ns[0], ns[RUNS / 2]);
+        first = false;
+    }
+    printf("\n]}\n");
+    return 0;
+}
@@ -0,0 +1,134 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <chrono>
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+// Each benchmark is a function that does ops operations of some kind,
+// timing only the part inside Bench::time. The runner calls it several
+// times and reports the time per operation as JSON (see bench.cpp).
+//
+//     BENCHMARK(Pool, create_free, "Pool<T>", 1 << 20) {
+//         Pool<Thing> pool;                   // not timed
+//         b.time([&]() { ... b.ops times ... });
+//     }
+//
+// Benchmarks of the same group and name but another impl (e.g. the std
+// equivalent) are meant to be compared with each other.
+
+class Bench {
+public:
+    explicit Bench(int ops) : ops(ops), elapsed(0) {}
+
+    const int ops;
+
+    template <class Func>
+    void time(Func func) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        func();
+        elapsed += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    double nanoseconds() { return elapsed; }
+
+private:
+    double elapsed;
+};
+
+typedef void (*BenchFunc)(Bench &b);
+
+struct BenchInfo {
+    const char *group;
+    const char *name;
+    const char *impl;
+    int ops;
+    BenchFunc func;
+};
+
+std::vector<BenchInfo> &benchmarks();
+
+struct BenchRegistrar {
+    BenchRegistrar(const char *group, const char *name, const char *impl, int ops, BenchFunc func) {
+        BenchInfo info = { group, name, impl, ops, func };
+        benchmarks().push_back(info);
+    }
+};
+
+#define BENCH_CONCAT2(a, b) a##b
+#define BENCH_CONCAT(a, b) BENCH_CONCAT2(a, b)
+
+// impl is a string so that it can hold template arguments
+#define BENCHMARK(group, name, impl, ops) \
+    static void BENCH_CONCAT(bench_, __LINE__)(Bench &b); \
+    static BenchRegistrar BENCH_CONCAT(bench_registrar_, __LINE__)(#group, #name, impl, ops, BENCH_CONCAT(bench_, __LINE__)); \
+    static void BENCH_CONCAT(bench_, __LINE__)(Bench &b)
+
+// keep the compiler from optimizing away a result
+void bench_use(uint64_t x);
+
+// for benchmarks that also check what they did. a failed check is reported
+// on stderr and the run ends with exit status 1
+void bench_check(bool ok, const char *what);
+
+// run func(i) for i from 0 to n - 1, each on a thread of its own, and wait
+// for them all. the threads are kept for the next call, as they would be
+// in a ThreadPool, since the concurrent pools keep state per thread
+void bench_threads(int n, const std::function<void(int)> &func);
+
+// threads in bench_threads wait for each other on this between phases
+class BenchBarrier {
+public:
+    explicit BenchBarrier(int n) : n(n), waiting(0), generation(0) {}
+
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        unsigned int gen = generation;
+        if (++waiting == n) {
+            waiting = 0;
+            ++generation;
+            cond.notify_all();
+            return;
+        }
+        while (gen == generation)
+            cond.wait(lock);
+    }
+
+private:
+    const int n;
+    int waiting;
+    unsigned int generation;
+    std::mutex mutex;
+    std::condition_variable cond;
+};
+
+template <class T>
+inline void bench_use_ptr(T *p) {
+    bench_use((uint64_t)(uintptr_t)p);
+}
+
+// a small, fast and deterministic random number generator, so that every
+// run sees the same data
+class BenchRandom {
+public:
+    explicit BenchRandom(uint64_t seed = 0x9e3779b97f4a7c15ull) : state(seed) {}
+
+    uint32_t next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return (uint32_t)(state >> 16);
+    }
+
+    float next_float(float lo, float hi) {
+        return lo + (hi - lo) * (float)(next() & 0xffffff) / (float)0x1000000;
+    }
+
+private:
+    uint64_t state;
+};
+
+#endif
@@ -0,0 +1,288 @@
+#include "bench.h"
+#include "util/fixedhashtable.h"
+#include "util/list.h"
+#include "util/hashtable.h"
+#include <unordered_map>
+#include <list>
+#include <vector>
+
+// values stored by key, like components by type
+
+struct Keyed {
+    unsigned int key;
+};
+
+struct KeyedKey {
+    static unsigned int key(Keyed *k) { return k->key; }
+};
+
+typedef FixedHashTable<8, Keyed *, KeyedKey> Table;
+
+enum {
+    TABLE_KEYS = 128, // half full
+    LOOKUPS = 1 << 20
+};
+
+static std::vector<Keyed> make_keyed(int n) {
+    BenchRandom rnd;
+    std::vector<Keyed> keyed(n);
+    for (int i = 0; i < n; ++i)
+        keyed[i].key = rnd.next() | 1; // 0 is not a valid key
+    return keyed;
+}
+
+BENCHMARK(FixedHashTable, insert, "FixedHashTable<8>", TABLE_KEYS * 1024) {
+    std::vector<Keyed> keyed = make_keyed(TABLE_KEYS);
+    Table *t = new Table;
+    b.time([&]() {
+        for (int r = 0; r < b.ops / TABLE_KEYS; ++r) {
+            t->clear();
+            for (int i = 0; i < TABLE_KEYS; ++i)
+                t->insert(&keyed[i]);
+        }
+    });
+    bench_use(t->maxprobe());
+    delete t;
+}
+
+BENCHMARK(FixedHashTable, insert, "std::unordered_map", TABLE_KEYS * 1024) {
+    std::vector<Keyed> keyed = make_keyed(TABLE_KEYS);
+    std::unordered_map<unsigned int, Keyed *> m;
+    b.time([&]() {
+        for (int r = 0; r < b.ops / TABLE_KEYS; ++r) {
+            m.clear();
+            for (int i = 0; i < TABLE_KEYS; ++i)
+                m[keyed[i].key] = &keyed[i];
+        }
+    });
+    bench_use(m.size());
+}
+
+BENCHMARK(FixedHashTable, lookup, "FixedHashTable<8>", LOOKUPS) {
+    std::vector<Keyed> keyed = make_keyed(TABLE_KEYS);
+    Table *t = new Table;
+    for (int i = 0; i < TABLE_KEYS; ++i)
+        t->insert(&keyed[i]);
+    b.time([&]() {
+        for (int i = 0; i < b.ops; ++i)
+            bench_use_ptr(t->lookup(keyed[i & (TABLE_KEYS - 1)].key));
+    });
+    delete t;
+}
+
+BENCHMARK(FixedHashTable, lookup, "FixedHashTable<8> optimized", LOOKUPS) {
+    std::vector<Keyed> keyed = make_keyed(TABLE_KEYS);
+    Table *t = new Table;
+    for (int i = 0; i < TABLE_KEYS; ++i)
+        t->insert(&keyed[i]);
+    t->optimize();
+    b.time([&]() {
+        for (int i = 0; i < b.ops; ++i)
+            bench_use_ptr(t->lookup(keyed[i & (TABLE_KEYS - 1)].key));
+    });
+    delete t;
+}
+
+BENCHMARK(FixedHashTable, lookup, "std::unordered_map", LOOKUPS) {
+    std::vector<Keyed> keyed = make_keyed(TABLE_KEYS);
+    std::unordered_map<unsigned int, Keyed *> m;
+    for (int i = 0; i < TABLE_KEYS; ++i)
+        m[keyed[i].key] = &keyed[i];
+    b.time([&]() {
+        for (int i = 0; i < b.ops; ++i)
+            bench_use_ptr(m.find(keyed[i & (TABLE_KEYS - 1)].key)->second);
+    });
+}
+
+BENCHMARK(FixedHashTable, lookup_miss, "FixedHashTable<8>", LOOKUPS) {
+    std::vector<Keyed> keyed = make_keyed(TABLE_KEYS * 2);
+    Table *t = new Table;
+    for (int i = 0; i < TABLE_KEYS; ++i)
+        t->insert(&keyed[i]);
+    b.time([&]() {
+        for (int i = 0; i < b.ops; ++i)
+            bench_use_ptr(t->lookup(keyed[TABLE_KEYS + (i & (TABLE_KEYS - 1))].key));
+    });
+    delete t;
+}
+
+BENCHMARK(FixedHashTable, lookup_miss, "std::unordered_map", LOOKUPS) {
+    std::vector<Keyed> keyed = make_keyed(TABLE_KEYS * 2);
+    std::unordered_map<unsigned int, Keyed *> m;
+    for (int i = 0; i < TABLE_KEYS; ++i)
+        m[keyed[i].key] = &keyed[i];
+    b.time([&]() {
+        for (int i = 0; i < b.ops; ++i)
+            bench_use(m.count(keyed[TABLE_KEYS + (i & (TABLE_KEYS - 1))].key));
+    });
+}
+
+// one op is building the perfect hash of a half full table
+BENCHMARK(FixedHashTable, optimize, "FixedHashTable<8>", 256) {
+    std::vector<Keyed> keyed = make_keyed(TABLE_KEYS * b.ops);
+    std::vector<Table> tables(b.ops);
+    for (int r = 0; r < b.ops; ++r)
+    for (int i = 0; i < TABLE_KEYS; ++i)
+        tables[r].insert(&keyed[r * TABLE_KEYS + i]);
+    b.time([&]() {
+        for (int r = 0; r < b.ops; ++r)
+            bench_use(tables[r].optimize());
+    });
+}
+
+
+// intrusive list against std::list of pointers
+
+struct Linked {
+    int value;
+    ListLink link;
+};
+
+enum { LIST_SIZE = 1 << 16 };
+
+BENCHMARK(List, push_pop, "List", LIST_SIZE * 16) {
+    std::vector<Linked> items(LIST_SIZE);
+    List<Linked, &Linked::link> list;
+    b.time([&]() {
+        for (int r = 0; r < b.ops / LIST_SIZE; ++r) {
+            for (int i = 0; i < LIST_SIZE; ++i)
+                list.push_back(&items[i]);
+            while (!list.empty())
+                list.pop_front();
+        }
+    });
+}
+
+BENCHMARK(List, push_pop, "std::list", LIST_SIZE * 16) {
+    std::vector<Linked> items(LIST_SIZE);
+    std::list<Linked *> list;
+    b.time([&]() {
+        for (int r = 0; r < b.ops / LIST_SIZE; ++r) {
+            for (int i = 0; i < LIST_SIZE; ++i)
+                list.push_back(&items[i]);
+            while (!list.empty())
+                list.pop_front();
+        }
+    });
+}
+
+// the items are linked in shuffled order, as they would be after a while
+static void shuffle_items(std::vector<Linked *> &order, std::vector<Linked> &items) {
+    BenchRandom rnd;
+    for (size_t i = 0; i < items.size(); ++i) {
+        items[i].value = (int)i;
+        order.push_back(&items[i]);
+    }
+    for (size_t i = order.size() - 1; i > 0; --i)
+        std::swap(order[i], order[rnd.next() % (i + 1)]);
+}
+
+BENCHMARK(List, iterate, "List", LIST_SIZE * 16) {
+    std::vector<Linked> items(LIST_SIZE);
+    std::vector<Linked *> order;
+    shuffle_items(order, items);
+    List<Linked, &Linked::link> list;
+    for (Linked *l : order)
+        list.push_back(l);
+    b.time([&]() {
+        int sum = 0;
+        for (int r = 0; r < b.ops / LIST_SIZE; ++r)
+        for (Linked *l : list)
+            sum += l->value;
+        bench_use(sum);
+    });
+}
+
+BENCHMARK(List, iterate, "std::list", LIST_SIZE * 16) {
+    std::vector<Linked> items(LIST_SIZE);
+    std::vector<Linked *> order;
+    shuffle_items(order, items);
+    std::list<Linked *> list(order.begin(), order.end());
+    b.time([&]() {
+        int sum = 0;
+        for (int r = 0; r < b.ops / LIST_SIZE; ++r)
+        for (Linked *l : list)
+            sum += l->value;
+        bench_use(sum);
+    });
+}
+
+
+// intrusive chained hash table against std::unordered_map. HashTable finds
+// calc_hash by argument dependent lookup, so the key gets a namespace
+
+namespace hashed {
+    struct Key {
+        unsigned int value;
+        bool operator==(const Key &k) const { return value == k.value; }
+    };
+
+    inline unsigned int calc_hash(Key k) {
+        return k.value * 2654435761u;
+    }
+}
+
+struct Hashed {
+    hashed::Key k;
+    ListLink link;
+
+    hashed::Key key() { return k; }
+};
+
+typedef HashTable<Hashed, &Hashed::link, hashed::Key, &Hashed::key> IntrusiveTable;
+
+enum { HASHED_SIZE = 1 << 14 };
+
+static std::vector<Hashed> make_hashed() {
+    BenchRandom rnd;
+    std::vector<Hashed> items(HASHED_SIZE);
+    for (int i = 0; i < HASHED_SIZE; ++i)
+        items[i].k.value = rnd.next();
+    return items;
+}
+
+BENCHMARK(HashTable, insert, "HashTable", HASHED_SIZE * 16) {
+    std::vector<Hashed> items = make_hashed();
+    IntrusiveTable table(HASHED_SIZE);
+    b.time([&]() {
+        for (int r = 0; r < b.ops / HASHED_SIZE; ++r) {
+            table.clear();
+            for (int i = 0; i < HASHED_SIZE; ++i)
+                table.insert(&items[i]);
+        }
+    });
+}
+
+BENCHMARK(HashTable, insert, "std::unordered_map", HASHED_SIZE * 16) {
+    std::vector<Hashed> items = make_hashed();
+    std::unordered_map<unsigned int, Hashed *> m(HASHED_SIZE);
+    b.time([&]() {
+        for (int r = 0; r < b.ops / HASHED_SIZE; ++r) {
+            m.clear();
+            for (int i = 0; i < HASHED_SIZE; ++i)
+                m[items[i].k.value] = &items[i];
+        }
+    });
+}
+
+BENCHMARK(HashTable, lookup, "HashTable", LOOKUPS) {
+    std::vector<Hashed> items = make_hashed();
+    IntrusiveTable table(HASHED_SIZE);
+    for (int i = 0; i < HASHED_SIZE; ++i)
+        table.insert(&items[i]);
+    b.time([&]() {
+        for (int i = 0; i < b.ops; ++i)
+            bench_use_ptr(table[items[i & (HASHED_SIZE - 1)].k]);
+    });
+}
+
+BENCHMARK(HashTable, lookup, "std::unordered_map", LOOKUPS) {
+    std::vector<Hashed> items = make_hashed();
+    std::unordered_map<unsigned int, Hashed *> m(HASHED_SIZE);
+    for (int i = 0; i < HASHED_SIZE; ++i)
+        m[items[i].k.value] = &items[i];
+    b.time([&]() {
+        for (int i = 0; i < b.ops; ++i)
+            bench_use_ptr(m.find(items[i & (HASHED_SIZE - 1)].k.value)->second);
+    });
+}
@@ -0,0 +1,162 @@
+#include "bench.h"
+#include "util/ringqueue.h"
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+
+// producers push numbered values which one consumer pops, checking that
+// each producer's values arrive complete and in order. one op is one value
+// passing through the queue
+
+enum {
+    PRODUCERS = 3,
+    QUEUE_CAPACITY = 1 << 10,
+    BATCH = 32,
+    VALUES = 1 << 18
+};
+
+static uint32_t make_value(int producer, int seq) {
+    return (uint32_t)producer << 24 | (uint32_t)seq;
+}
+
+class OrderCheck {
+public:
+    explicit OrderCheck(int producers) : producers(producers), sum(0), ok(true) {
+        std::fill(next, next + PRODUCERS, 0);
+    }
+
+    void see(uint32_t v) {
+        int p = (int)(v >> 24);
+        int seq = (int)(v & 0xffffff);
+        if (p >= producers || seq != next[p])
+            ok = false;
+        else
+            ++next[p];
+        sum += seq;
+    }
+
+    bool complete(int per_producer) {
+        for (int p = 0; p < producers; ++p)
+        if (next[p] != per_producer)
+            return false;
+        return ok && sum == (uint64_t)producers * per_producer * (per_producer - 1) / 2;
+    }
+
+private:
+    int producers;
+    int next[PRODUCERS];
+    uint64_t sum;
+    bool ok;
+};
+
+// push(uint32_t *vals, int n) pushes all n values, waiting for room.
+// pop(uint32_t *out, int max) waits for values and returns how many it got
+template <class Push, class Pop>
+static void pass_values(Bench &b, int producers, int batch, Push push, Pop pop) {
+    int per_producer = b.ops / producers;
+    bool ok = false;
+    b.time([&]() {
+        bench_threads(producers + 1, [&](int t) {
+            uint32_t buf[BATCH];
+            if (t == 0) {
+                OrderCheck check(producers);
+                for (int received = 0; received < per_producer * producers; ) {
+                    int n = pop(buf, batch);
+                    for (int i = 0; i < n; ++i)
+                        check.see(buf[i]);
+                    received += n;
+                }
+                ok = check.complete(per_producer);
+                return;
+            }
+            int producer = t - 1;
+            for (int seq = 0; seq < per_producer; ) {
+                int n = std::min(batch, per_producer - seq);
+                for (int i = 0; i < n; ++i)
+                    buf[i] = make_value(producer, seq + i);
+                push(buf, n);
+                seq += n;
+            }
+        });
+    });
+    bench_check(ok, "every value was popped once, in order per producer");
+}
+
+// the usual alternative: a deque under a mutex, with condition variables
+// to wait on
+class LockedQueue {
+public:
+    explicit LockedQueue(int capacity) : capacity(capacity) {}
+
+    void push_n(uint32_t *vals, int n) {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (int i = 0; i < n; ++i) {
+            while ((int)values.size() == capacity)
+                not_full.wait(lock);
+            values.push_back(vals[i]);
+            not_empty.notify_one();
+        }
+    }
+
+    int pop_n(uint32_t *out, int max) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (values.empty())
+            not_empty.wait(lock);
+        int n = std::min(max, (int)values.size());
+        std::copy(values.begin(), values.begin() + n, out);
+        values.erase(values.begin(), values.begin() + n);
+        not_full.notify_all();
+        return n;
+    }
+
+private:
+    int capacity;
+    std::deque<uint32_t> values;
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+};
+
+
+BENCHMARK(Queue, mpsc, "MpscQueue push_n/pop_n", VALUES) {
+    MpscQueue<uint32_t> q(QUEUE_CAPACITY);
+    pass_values(b, PRODUCERS, BATCH,
+        [&](uint32_t *vals, int n) { q.push_n(vals, n); },
+        [&](uint32_t *out, int max) { return q.pop_n(out, max); });
+}
+
+BENCHMARK(Queue, mpsc, "MpscQueue push/pop", VALUES) {
+    MpscQueue<uint32_t> q(QUEUE_CAPACITY);
+    pass_values(b, PRODUCERS, 1,
+        [&](uint32_t *vals, int) { q.push(vals[0]); },
+        [&](uint32_t *out, int) { q.pop(out[0]); return 1; });
+}
+
+BENCHMARK(Queue, mpsc, "mutex + deque", VALUES) {
+    LockedQueue q(QUEUE_CAPACITY);
+    pass_values(b, PRODUCERS, BATCH,
+        [&](uint32_t *vals, int n) { q.push_n(vals, n); },
+        [&](uint32_t *out, int max) { return q.pop_n(out, max); });
+}
+
+BENCHMARK(Queue, spsc, "SpscQueue push_n/pop_n", VALUES) {
+    SpscQueue<uint32_t> q(QUEUE_CAPACITY);
+    pass_values(b, 1, BATCH,
+        [&](uint32_t *vals, int n) { q.push_n(vals, n); },
+        [&](uint32_t *out, int max) { return q.pop_n(out, max); });
+}
+
+BENCHMARK(Queue, spsc, "SpscQueue push/pop", VALUES) {
+    SpscQueue<uint32_t> q(QUEUE_CAPACITY);
+    pass_values(b, 1, 1,
+        [&](uint32_t *vals, int) { q.push(vals[0]); },
+        [&](uint32_t *out, int) { q.pop(out[0]); return 1; });
+}
+
+BENCHMARK(Queue, spsc, "mutex + deque", VALUES) {
+    LockedQueue q(QUEUE_CAPACITY);
+    pass_values(b, 1, BATCH,
+        [&](uint32_t *vals, int n) { q.push_n(vals, n); },
+        [&](uint32_t *out, int max) { return q.pop_n(out, max); });
+}
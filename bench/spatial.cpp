@@ -0,0 +1,106 @@
+#include "bench.h"
+#include "game/quadtree.h"
+#include <vector>
+#include <algorithm>
+
+// points spread over the tree, queried with boxes about the size of a
+// ship's neighborhood
+
+struct Point : public QuadTree::Object {
+    float x, y;
+
+    void qtree_position(float &px, float &py) override {
+        px = x;
+        py = y;
+    }
+};
+
+enum {
+    POINTS = 1 << 12,
+    QUERIES = 1 << 14
+};
+
+static const float EXTENT = 1000;
+static const float QUERY_RADIUS = 50;
+
+static void scatter(std::vector<Point> &points) {
+    BenchRandom rnd;
+    for (Point &p : points) {
+        p.x = rnd.next_float(-EXTENT, EXTENT);
+        p.y = rnd.next_float(-EXTENT, EXTENT);
+    }
+}
+
+BENCHMARK(QuadTree, insert_remove, "QuadTree", POINTS * 16) {
+    std::vector<Point> points(POINTS);
+    scatter(points);
+    QuadTree tree(-EXTENT, -EXTENT, EXTENT, EXTENT, 8);
+    b.time([&]() {
+        for (int r = 0; r < b.ops / POINTS; ++r) {
+            for (Point &p : points)
+                tree.insert(&p);
+            for (Point &p : points)
+                tree.remove(&p);
+        }
+    });
+}
+
+// every point moves a little and is updated, as bodies are each frame
+BENCHMARK(QuadTree, move, "QuadTree", POINTS * 16) {
+    QuadTree tree(-EXTENT, -EXTENT, EXTENT, EXTENT, 8); // outlives the points in it
+    std::vector<Point> points(POINTS);
+    scatter(points);
+    for (Point &p : points)
+        tree.insert(&p);
+    BenchRandom rnd;
+    b.time([&]() {
+        for (int r = 0; r < b.ops / POINTS; ++r)
+        for (Point &p : points) {
+            p.x = std::max(-EXTENT, std::min(EXTENT, p.x + rnd.next_float(-2, 2)));
+            p.y = std::max(-EXTENT, std::min(EXTENT, p.y + rnd.next_float(-2, 2)));
+            p.qtree_update();
+        }
+    });
+}
+
+BENCHMARK(QuadTree, query, "QuadTree", QUERIES) {
+    QuadTree tree(-EXTENT, -EXTENT, EXTENT, EXTENT, 8); // outlives the points in it
+    std::vector<Point> points(POINTS);
+    scatter(points);
+    for (Point &p : points)
+        tree.insert(&p);
+    BenchRandom rnd;
+    b.time([&]() {
+        int found = 0;
+        for (int i = 0; i < b.ops; ++i) {
+            float x = rnd.next_float(-EXTENT, EXTENT);
+            float y = rnd.next_float(-EXTENT, EXTENT);
+            tree.query(x - QUERY_RADIUS, y - QUERY_RADIUS, x + QUERY_RADIUS, y + QUERY_RADIUS,
+                       [&](QuadTree::Object *obj) {
+                Point *p = static_cast<Point *>(obj);
+                if (p->x >= x - QUERY_RADIUS && p->x <= x + QUERY_RADIUS &&
+                    p->y >= y - QUERY_RADIUS && p->y <= y + QUERY_RADIUS)
+                    ++found;
+            });
+        }
+        bench_use(found);
+    });
+}
+
+BENCHMARK(QuadTree, query, "linear scan", QUERIES) {
+    std::vector<Point> points(POINTS);
+    scatter(points);
+    BenchRandom rnd;
+    b.time([&]() {
+        int found = 0;
+        for (int i = 0; i < b.ops; ++i) {
+            float x = rnd.next_float(-EXTENT, EXTENT);
+            float y = rnd.next_float(-EXTENT, EXTENT);
+            for (const Point &p : points)
+            if (p.x >= x - QUERY_RADIUS && p.x <= x + QUERY_RADIUS &&
+                p.y >= y - QUERY_RADIUS && p.y <= y + QUERY_RADIUS)
+                ++found;
+        }
+        bench_use(found);
+    });
+}
@@ -1,10 +1,18 @@
 #include "ecos.h"
+#include "util/concurrentpool.h"
 #include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 
 
 
 
 Component *Entity::get_component(ComponentType type) {
+    for (int i = 0; i < MAX_INDEXED_COMPONENTS; ++i)
+    if (slots[i] && slots[i]->type() == type)
+        return slots[i];
+
     ComponentBlock *b = &block;
     do {
         Component *c = b->table.lookup(type);
@@ -18,20 +26,418 @@ Component *Entity::get_component(ComponentType type) {
 
 
 
+static int align16(int n) {
+    return (n + 15) & ~15;
+}
+
+Archetype::Archetype(ComponentMask signature, const int *field_sizes, const ComponentMask *field_owners)
+    : _signature(signature), num_fields(0)
+{
+    int row_bytes = sizeof(Entity *);
+    for (int f = 0; f < MAX_FIELDS; ++f) {
+        if (field_sizes[f] && (field_owners[f] & signature)) {
+            field_index[num_fields] = f;
+            field_size[num_fields] = field_sizes[f];
+            row_bytes += field_sizes[f];
+            ++num_fields;
+        }
+    }
+
+    // leave room for the header and for aligning every array
+    int usable = CHUNK_BYTES - align16(sizeof(ArchetypeChunk)) - 16*(num_fields + 1);
+    capacity = usable / row_bytes;
+    assert(capacity > 0);
+
+    int offset = align16(sizeof(ArchetypeChunk)) + align16(capacity*sizeof(Entity *));
+    for (int i = 0; i < num_fields; ++i) {
+        field_offset[i] = offset;
+        offset += align16(capacity*field_size[i]);
+    }
+    assert(offset <= CHUNK_BYTES);
+}
+
+Archetype::~Archetype() {
+    for (ArchetypeChunk *c : chunks)
+        ::free(c);
+}
+
+ArchetypeChunk *Archetype::new_chunk() {
+    char *mem = (char *)::malloc(CHUNK_BYTES);
+    ArchetypeChunk *c = (ArchetypeChunk *)mem;
+    c->archetype = this;
+    c->count = 0;
+    c->entities = (Entity **)(mem + align16(sizeof(ArchetypeChunk)));
+    for (int f = 0; f < MAX_FIELDS; ++f)
+        c->fields[f] = nullptr;
+    for (int i = 0; i < num_fields; ++i)
+        c->fields[field_index[i]] = mem + field_offset[i];
+    chunks.push_back(c);
+    return c;
+}
+
+void Archetype::insert(Entity *e, ArchetypeChunk *&chunk, int &row) {
+    ArchetypeChunk *c = chunks.empty() ? nullptr : chunks.back();
+    if (!c || c->count == capacity)
+        c = new_chunk();
+    row = c->count++;
+    c->entities[row] = e;
+    for (int i = 0; i < num_fields; ++i)
+        memset(c->fields[field_index[i]] + row*field_size[i], 0, field_size[i]);
+    chunk = c;
+}
+
+Entity *Archetype::remove(ArchetypeChunk *chunk, int row) {
+    assert(chunk->archetype == this);
+    ArchetypeChunk *last = chunks.back();
+    int last_row = last->count - 1;
+    Entity *moved = nullptr;
+
+    if (chunk != last || row != last_row) {
+        moved = last->entities[last_row];
+        chunk->entities[row] = moved;
+        for (int i = 0; i < num_fields; ++i) {
+            int f = field_index[i];
+            int size = field_size[i];
+            memcpy(chunk->fields[f] + row*size, last->fields[f] + last_row*size, size);
+        }
+    }
+
+    if (--last->count == 0) {
+        chunks.pop_back();
+        ::free(last);
+    }
+    return moved;
+}
+
+
+
+
+EntityManager::EntityManager() :
+    field_owner_mask(0), free_head(0), free_tail(0),
+    tick(1), log_start_tick(0), frame_count(0),
+    last_frame_allocations(0), frame_dt(0), frame_pool(nullptr), frame_group(nullptr)
+{
+    block_pool.set_name("ComponentBlock");
+    entity_pool.set_name("Entity");
+
+    for (int i = 0; i < CHANGE_LOG_FRAMES; ++i)
+        frame_ticks[i] = 0;
+
+    // slot 0 is never handed out, which makes the all-zero handle null
+    EntitySlot null_slot = { nullptr, 0, 0 };
+    entity_slots.push_back(null_slot);
+
+    for (int f = 0; f < MAX_FIELDS; ++f) {
+        field_sizes[f] = 0;
+        field_owners[f] = 0;
+    }
+    for (int i = 0; i < (1 << MAX_INDEXED_COMPONENTS); ++i)
+        archetypes[i] = nullptr;
+}
+
 EntityManager::~EntityManager() {
     for (Entity *e : entity_pool)
         really_destroy_entity(e);
+    for (Archetype *a : archetype_list)
+        delete a;
+    for (auto &entry : command_buffers)
+        delete entry.second;
 }
 
 void EntityManager::update() {
+    play_commands();
+
     for (Entity *e : kill_this_time)
         really_destroy_entity(e);
-    kill_this_time = kill_next_time;
-    kill_next_time.clear();
+    // swapped rather than copied, so both keep their capacity
+    kill_this_time.clear();
+    kill_this_time.swap(kill_next_time);
+    trim_change_logs();
+}
+
+void EntityManager::trim_change_logs() {
+    // drop whatever was logged before the update() CHANGE_LOG_FRAMES ago
+    unsigned int oldest = frame_ticks[frame_count % CHANGE_LOG_FRAMES];
+    frame_ticks[frame_count % CHANGE_LOG_FRAMES] = tick;
+    ++frame_count;
+
+    if (oldest <= log_start_tick)
+        return;
+    for (int i = 0; i < MAX_INDEXED_COMPONENTS; ++i) {
+        std::vector<ChangeEntry> &log = change_logs[i];
+        log.erase(log.begin(), std::lower_bound(log.begin(), log.end(), oldest));
+    }
+    log_start_tick = oldest;
+}
+
+void EntityManager::schedule_system(System *s) {
+    ScheduledSystem n;
+    n.system = s;
+    n.reads = s->reads();
+    n.writes = s->writes();
+    n.num_dependencies = 0;
+    n.allocations = 0;
+
+    int index = (int)schedule.size();
+    for (ScheduledSystem &prev : schedule) {
+        if ((prev.writes & (n.reads | n.writes)) || (prev.reads & n.writes)) {
+            prev.dependents.push_back(index);
+            ++n.num_dependencies;
+        }
+    }
+    schedule.push_back(n);
+    remaining_dependencies.resize(schedule.size());
+}
+
+void EntityManager::run_frame(float dt, ThreadPool *pool) {
+    unsigned int start = allocation_count();
+    frame_dt = dt;
+    if (!pool || schedule.size() < 2) {
+        for (size_t i = 0; i < schedule.size(); ++i)
+            update_scheduled((int)i);
+    } else {
+        for (size_t i = 0; i < schedule.size(); ++i)
+            remaining_dependencies[i] = schedule[i].num_dependencies;
+
+        ThreadPool::Group group;
+        frame_pool = pool;
+        frame_group = &group;
+        for (size_t i = 0; i < schedule.size(); ++i) {
+            if (schedule[i].num_dependencies == 0) {
+                int index = (int)i;
+                pool->submit(group, [this, index]() { run_scheduled(index); });
+            }
+        }
+        pool->wait(group);
+        frame_pool = nullptr;
+        frame_group = nullptr;
+    }
+
+    update();
+    last_frame_allocations = allocation_count() - start;
+}
+
+unsigned int EntityManager::system_allocations(System *s) {
+    for (ScheduledSystem &entry : schedule)
+    if (entry.system == s)
+        return entry.allocations;
+    return 0;
+}
+
+// runs system i, then submits the dependents that no longer wait for anything
+void EntityManager::run_scheduled(int i) {
+    update_scheduled(i);
+
+    for (int d : schedule[i].dependents) {
+        bool ready;
+        {
+            std::lock_guard<std::mutex> lock(schedule_mutex);
+            ready = --remaining_dependencies[d] == 0;
+        }
+        if (ready)
+            frame_pool->submit(*frame_group, [this, d]() { run_scheduled(d); });
+    }
+}
+
+// writes() of the system running on this thread, for checking touch()
+static POOL_THREAD_LOCAL bool in_system;
+static POOL_THREAD_LOCAL ComponentMask system_writes;
+
+// a system's update runs on one thread, so that thread's count is its own
+void EntityManager::update_scheduled(int i) {
+    ScheduledSystem &s = schedule[i];
+    // saved, since waiting on the pool may run another world's system here
+    bool was_in_system = in_system;
+    ComponentMask was_writes = system_writes;
+    in_system = true;
+    system_writes = s.writes;
+
+    unsigned int start = thread_allocation_count();
+    s.system->update(this, frame_dt);
+    s.allocations = thread_allocation_count() - start;
+
+    in_system = was_in_system;
+    system_writes = was_writes;
+}
+
+CommandBuffer *EntityManager::command_buffer() {
+    std::lock_guard<std::mutex> lock(command_mutex);
+    std::thread::id id = std::this_thread::get_id();
+    for (auto &entry : command_buffers)
+    if (entry.first == id)
+        return entry.second;
+    CommandBuffer *buf = new CommandBuffer;
+    command_buffers.push_back(std::make_pair(id, buf));
+    return buf;
+}
+
+void EntityManager::play_commands() {
+    // move the commands aside first, so anything recorded during playback
+    // waits for the next update. the lock is not held while playing, so
+    // init callbacks may record more commands
+    {
+        std::lock_guard<std::mutex> lock(command_mutex);
+        unsigned int order = 0;
+        playback.clear();
+        replaying.clear();
+        for (auto &entry : command_buffers) {
+            CommandBuffer *buf = entry.second;
+            if (buf->commands.empty())
+                continue;
+            buf->begin_replay();
+            replaying.push_back(buf);
+            for (const CommandBuffer::Command &cmd : buf->replay) {
+                PlaybackEntry p = { cmd.key, order++, &cmd };
+                playback.push_back(p);
+            }
+        }
+    }
+    if (playback.empty())
+        return;
+    std::sort(playback.begin(), playback.end());
+
+    // reserve for all the spawns at once, as spawn_batch does
+    spawn_counts.assign(templates.size(), 0);
+    for (const PlaybackEntry &p : playback)
+    if (p.cmd->op == CommandBuffer::SPAWN)
+        ++spawn_counts[p.cmd->tmpl];
+    for (size_t i = 0; i < templates.size(); ++i)
+    if (spawn_counts[i])
+        reserve(*templates[i], spawn_counts[i]);
+
+    for (const PlaybackEntry &p : playback)
+        play_command(*p.cmd);
+
+    playback.clear();
+    for (CommandBuffer *buf : replaying)
+        buf->end_replay();
+}
+
+void EntityManager::play_command(const CommandBuffer::Command &cmd) {
+    if (cmd.op == CommandBuffer::SPAWN) {
+        Entity *e = spawn(*templates[cmd.tmpl]);
+        if (cmd.init)
+            cmd.init(e, cmd.bound);
+        init_entity(e);
+        return;
+    }
+
+    Entity *e = resolve(cmd.entity);
+    if (!e || e->dying())
+        return;
+
+    switch (cmd.op) {
+    case CommandBuffer::DESTROY:
+        destroy_entity(e);
+        break;
+    case CommandBuffer::ADD: {
+        if (cmd.index != NO_INDEX ? e->slots[cmd.index] != nullptr : e->get_component(cmd.type) != nullptr)
+            break;
+        Component *c = cmd.create(this);
+        add_component(e, c);
+        if (cmd.init)
+            cmd.init(e, cmd.bound);
+        c->init(this, e);
+        break;
+    }
+    case CommandBuffer::DEL:
+        if (cmd.index != NO_INDEX)
+            del_indexed_component(e, cmd.index);
+        else
+            del_component(e, cmd.type);
+        break;
+    default:
+        break;
+    }
+}
+
+void EntityManager::log_change(Component *c) {
+    int index = c->index();
+    if (index != NO_INDEX) {
+        ChangeEntry entry = { c->entity->_handle, c->version };
+        change_logs[index].push_back(entry);
+    }
+}
+
+bool EntityManager::may_touch(Component *c) {
+    int index = c->index();
+    return !in_system || index == NO_INDEX || (system_writes & ((ComponentMask)1 << index));
 }
 
 Entity *EntityManager::create_entity() {
-    return entity_pool.create();
+    Entity *e = entity_pool.create();
+    e->_manager = this;
+    e->_handle = alloc_handle(e);
+    return e;
+}
+
+EntityHandle EntityManager::alloc_handle(Entity *e) {
+    unsigned int index;
+    if (free_head) {
+        index = free_head;
+        free_head = entity_slots[index].next_free;
+        if (!free_head)
+            free_tail = 0;
+    } else {
+        index = entity_slots.size();
+        // a wrapped index would alias a live entity, so stop here in release too
+        if (index >= EntityHandle::MAX_ENTITIES) {
+            fprintf(stderr, "EntityManager: out of entity handles (max %d)\n", (int)EntityHandle::MAX_ENTITIES);
+            abort();
+        }
+        EntitySlot slot = { nullptr, 1, 0 };
+        entity_slots.push_back(slot);
+    }
+    EntitySlot &slot = entity_slots[index];
+    slot.entity = e;
+    slot.next_free = 0;
+    return EntityHandle(index, slot.generation);
+}
+
+void EntityManager::free_handle(EntityHandle h) {
+    unsigned int index = h.index();
+    EntitySlot &slot = entity_slots[index];
+    assert(slot.generation == h.generation());
+    slot.entity = nullptr;
+    // generation 0 is skipped so that no live handle is ever all-zero
+    if (++slot.generation == (1u << EntityHandle::GENERATION_BITS))
+        slot.generation = 1;
+    if (free_tail)
+        entity_slots[free_tail].next_free = index;
+    else
+        free_head = index;
+    free_tail = index;
+}
+
+void EntityManager::reserve(EntityTemplate &t, int count) {
+    entity_pool.reserve(count);
+    for (EntityTemplate::Entry &entry : t.entries)
+        entry.reserve(this, count);
+}
+
+Entity *EntityManager::spawn(EntityTemplate &t) {
+    Entity *e = create_entity();
+
+    // the unindexed components are inserted in the same order every time,
+    // so reusing the hash function reproduces the optimized table layout
+    if (t.hash_known)
+        e->block.table.clear(t.hash);
+
+    bool unindexed = false;
+    for (EntityTemplate::Entry &entry : t.entries) {
+        attach_component(e, entry.create(this));
+        unindexed = unindexed || entry.index == NO_INDEX;
+    }
+    update_archetype(e); // only move into an archetype once
+
+    if (e->block.next) {
+        optimize_entity(e); // overflow blocks are not covered by the template
+    } else if (unindexed && !t.hash_known) {
+        optimize_entity(e);
+        t.hash = e->block.table.hash_function();
+        t.hash_known = true;
+    }
+    return e;
 }
 
 void EntityManager::destroy_entity(Entity *e) {
@@ -40,6 +446,10 @@ void EntityManager::destroy_entity(Entity *e) {
 }
 
 void EntityManager::really_destroy_entity(Entity *e) {
+    for (int i = 0; i < MAX_INDEXED_COMPONENTS; ++i)
+    if (e->slots[i])
+        e->slots[i]->destroy(this);
+
     Entity::ComponentBlock *b = &e->block;
     do {
         Entity::ComponentBlock *next = b->next;
@@ -49,18 +459,75 @@ void EntityManager::really_destroy_entity(Entity *e) {
             block_pool.free(b);
         b = next;
     } while (b);
+    remove_from_archetype(e);
+    free_handle(e->_handle);
     entity_pool.free(e);
 }
 
+void EntityManager::compact() {
+    entity_pool.compact([this](Entity *from, Entity *to) { relocate_entity(from, to); });
+    for (System *s : systems)
+        s->compact(this);
+    block_pool.trim();
+}
+
+void EntityManager::relocate_entity(Entity *from, Entity *to) {
+    entity_slots[to->_handle.index()].entity = to;
+    if (to->_chunk)
+        to->_chunk->entities[to->_row] = to;
+
+    for (int i = 0; i < MAX_INDEXED_COMPONENTS; ++i)
+    if (to->slots[i])
+        to->slots[i]->entity = to;
+
+    Entity::ComponentBlock *b = &to->block;
+    do {
+        for (Component *c : b->table)
+            c->entity = to;
+        b = b->next;
+    } while (b);
+
+    // dying entities are rare, so just search for it
+    std::replace(kill_next_time.begin(), kill_next_time.end(), from, to);
+    std::replace(kill_this_time.begin(), kill_this_time.end(), from, to);
+}
+
+void EntityManager::relocate_component(Component *from, Component *to) {
+    Entity *e = to->entity;
+    if (!e)
+        return; // not added to an entity yet
+
+    int index = to->index();
+    if (index != NO_INDEX) {
+        assert(e->slots[index] == from);
+        e->slots[index] = to;
+        return;
+    }
+
+    Entity::ComponentBlock *b = &e->block;
+    do {
+        if (b->table.lookup(to->type()) == from) {
+            b->table.replace(to);
+            return;
+        }
+        b = b->next;
+    } while (b);
+    assert(!"component not found in its entity");
+}
+
 void EntityManager::optimize_entity(Entity *e) {
     Entity::ComponentBlock *b = &e->block;
     do {
-        b->table.optimize(rnd);
+        b->table.optimize();
         b = b->next;
     } while (b);
 }
 
 void EntityManager::init_entity(Entity *e) {
+    for (int i = 0; i < MAX_INDEXED_COMPONENTS; ++i)
+    if (e->slots[i])
+        e->slots[i]->init(this, e);
+
     Entity::ComponentBlock *b = &e->block;
     do {
         for (Component *c : b->table)
@@ -70,10 +537,34 @@ void EntityManager::init_entity(Entity *e) {
 }
 
 void EntityManager::add_component(Entity *e, Component *c) {
-    add_component(&e->block, c);
+    if (attach_component(e, c))
+        update_archetype(e);
+}
+
+// returns true if the signature changed
+bool EntityManager::attach_component(Entity *e, Component *c) {
+    c->entity = e;
+    int index = c->index();
+    if (index == NO_INDEX) {
+        add_component(&e->block, c);
+        return false;
+    }
+    assert(index >= 0 && index < MAX_INDEXED_COMPONENTS);
+    assert(!e->slots[index]);
+    e->slots[index] = c;
+    e->_signature |= (ComponentMask)1 << index;
+    touch(c); // a new component counts as changed
+    return true;
 }
 
 void EntityManager::del_component(Entity *e, ComponentType type) {
+    for (int i = 0; i < MAX_INDEXED_COMPONENTS; ++i) {
+        if (e->slots[i] && e->slots[i]->type() == type) {
+            del_indexed_component(e, i);
+            return;
+        }
+    }
+
     Entity::ComponentBlock *b = &e->block;
     do {
         Component *c = b->table.remove(type);
@@ -86,6 +577,82 @@ void EntityManager::del_component(Entity *e, ComponentType type) {
     } while (b);
 }
 
+void EntityManager::del_indexed_component(Entity *e, int index) {
+    Component *c = e->slots[index];
+    if (c) {
+        e->slots[index] = nullptr;
+        e->_signature &= ~((ComponentMask)1 << index);
+        c->destroy(this);
+        update_archetype(e);
+    }
+}
+
+void EntityManager::update_archetype(Entity *e) {
+    Archetype *from = e->_chunk ? e->_chunk->archetype : nullptr;
+    Archetype *to = nullptr;
+
+    if (e->_signature & field_owner_mask) {
+        to = archetypes[e->_signature];
+        if (!to) {
+            to = new Archetype(e->_signature, field_sizes, field_owners);
+            archetypes[e->_signature] = to;
+            archetype_list.push_back(to);
+        }
+    }
+
+    if (from == to)
+        return;
+
+    ArchetypeChunk *old_chunk = e->_chunk;
+    int old_row = e->_row;
+
+    if (to) {
+        // the fields that both archetypes have are carried over
+        to->insert(e, e->_chunk, e->_row);
+        if (from) {
+            for (int i = 0; i < to->num_fields; ++i) {
+                int f = to->field_index[i];
+                int size = to->field_size[i];
+                if (old_chunk->fields[f])
+                    memcpy(e->_chunk->fields[f] + e->_row*size, old_chunk->fields[f] + old_row*size, size);
+            }
+        }
+    } else {
+        e->_chunk = nullptr;
+        e->_row = 0;
+    }
+
+    if (from) {
+        Entity *moved = from->remove(old_chunk, old_row);
+        if (moved) {
+            moved->_chunk = old_chunk;
+            moved->_row = old_row;
+        }
+    }
+}
+
+void EntityManager::remove_from_archetype(Entity *e) {
+    if (!e->_chunk)
+        return;
+    Entity *moved = e->_chunk->archetype->remove(e->_chunk, e->_row);
+    if (moved) {
+        moved->_chunk = e->_chunk;
+        moved->_row = e->_row;
+    }
+    e->_chunk = nullptr;
+}
+
+void EntityManager::add_field(int field, int component_index, int size) {
+    assert(field >= 0 && field < MAX_FIELDS);
+    assert(component_index >= 0 && component_index < MAX_INDEXED_COMPONENTS);
+    assert(size > 0);
+    assert(!field_sizes[field]);
+    assert(archetype_list.empty() && "fields must be added before entities are placed");
+    field_sizes[field] = size;
+    field_owners[field] = (ComponentMask)1 << component_index;
+    field_owner_mask |= field_owners[field];
+}
+
 void EntityManager::add_component(Entity::ComponentBlock *block, Component *c) {
     Entity::ComponentBlock *b = block;
 
@@ -108,6 +675,12 @@ void EntityManager::add_system(System *s) {
     assert(ok);
 }
 
+void EntityManager::add_template(EntityTemplate &t) {
+    assert(t.index < 0);
+    t.index = (int)templates.size();
+    templates.push_back(&t);
+}
+
 void EntityManager::optimize_systems() {
-    systems.optimize(rnd);
+    systems.optimize();
 }
@@ -3,62 +3,246 @@
 
 #include "util/fixedhashtable.h"
 #include "util/pool.h"
-#include "deps/mtrand.h"
+#include "util/threadpool.h"
+#include "util/allocstats.h"
+#include "util/arena.h"
 #include <vector>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <cassert>
 
 class Entity;
 class EntityManager;
+class EntityTemplate;
+class Archetype;
 
 typedef unsigned int SystemType;
 typedef unsigned int ComponentType;
+typedef unsigned int ComponentMask;
+
+// statically known component types get a dense index below this, which
+// maps them directly to a slot in the entity and a bit in its signature.
+// other component types are stored in the entity's component hash table.
+const int MAX_INDEXED_COMPONENTS = 8;
+const int NO_INDEX = -1;
+
+static_assert(MAX_INDEXED_COMPONENTS <= sizeof(ComponentMask)*8, "signature too small");
+
+// max number of hot fields that can be registered for archetype storage
+const int MAX_FIELDS = 16;
 
 
 class System {
 public:
     ~System() {}
     virtual SystemType type() = 0;
+
+    // Masks of the indexed component types that update() reads and writes
+    // (see component_mask). run_frame() lets two systems run at the same
+    // time only if neither writes what the other reads or writes, so any
+    // shared state besides components must be covered by these as well.
+    virtual ComponentMask reads() { return 0; }
+    virtual ComponentMask writes() { return 0; }
+
+    // called by EntityManager::run_frame() if the system is scheduled.
+    // structural changes must go through EntityManager::command_buffer()
+    virtual void update(EntityManager * /*m*/, float /*dt*/) {}
+
+    // move the system's components closer together and release storage
+    // they no longer need. see EntityManager::compact
+    virtual void compact(EntityManager * /*m*/) {}
 };
 
 
 class Component {
 public:
+    enum { INDEX = NO_INDEX }; // override with a dense index if known statically
+
+    Entity *entity; // owner, set when the component is added to an entity
+    unsigned int version; // change tick of the last write, see touch()
+
+    Component() : entity(nullptr), version(0) {}
     virtual ~Component() {}
     virtual ComponentType type() = 0;
+    virtual int index() { return NO_INDEX; }
     virtual void destroy(EntityManager *m) = 0;
     virtual void init(EntityManager *m, Entity *e) {}
+
+    // record that the component was written in the current change tick.
+    // mutable accessors should call this, so that systems can skip
+    // components which have not changed (see EntityManager::each_changed)
+    void touch();
+};
+
+
+// A weak, generational reference to an entity. Unlike an Entity pointer it
+// can be kept across frames; EntityManager::resolve() turns it back into a
+// pointer in O(1), or null once the entity has been destroyed.
+class EntityHandle {
+public:
+    enum {
+        INDEX_BITS = 20,
+        GENERATION_BITS = 32 - INDEX_BITS,
+        MAX_ENTITIES = 1 << INDEX_BITS
+    };
+
+    EntityHandle() : bits(0) {} // the null handle
+
+    unsigned int index() const { return bits & (MAX_ENTITIES - 1); }
+    unsigned int generation() const { return bits >> INDEX_BITS; }
+
+    explicit operator bool() const { return bits != 0; }
+    bool operator==(EntityHandle h) const { return bits == h.bits; }
+    bool operator!=(EntityHandle h) const { return bits != h.bits; }
+
+private:
+    friend class EntityManager;
+
+    EntityHandle(unsigned int index, unsigned int generation)
+        : bits(index | (generation << INDEX_BITS)) {}
+
+    unsigned int bits;
 };
 
 
+// A chunk holds the hot fields of up to Archetype::chunk_capacity() entities
+// which all have the same signature. Every field is stored as its own
+// contiguous array, so systems can stream through e.g. positions without
+// touching anything else.
+struct ArchetypeChunk {
+    Archetype *archetype;
+    int count;
+    Entity **entities;
+    char *fields[MAX_FIELDS]; // null for fields not in this archetype
+
+    int size() { return count; }
+    Entity *entity(int row) { return entities[row]; }
+
+    template <class T>
+    T *field(int f) {
+        assert(fields[f]);
+        return (T *)fields[f];
+    }
+};
+
+
+class Archetype {
+public:
+    enum { CHUNK_BYTES = 1024*16 };
+
+    ComponentMask signature() { return _signature; }
+    int chunk_capacity() { return capacity; }
+
+    std::vector<ArchetypeChunk *>::iterator begin() { return chunks.begin(); }
+    std::vector<ArchetypeChunk *>::iterator end() { return chunks.end(); }
+
+private:
+    friend class EntityManager;
+
+    Archetype(ComponentMask signature, const int *field_sizes, const ComponentMask *field_owners);
+    ~Archetype();
+
+    // non-copyable
+    Archetype(const Archetype &);
+    Archetype &operator=(const Archetype &);
+
+    // append a row for e at the end of the last chunk
+    void insert(Entity *e, ArchetypeChunk *&chunk, int &row);
+
+    // fill the hole at (chunk, row) with the very last row, keeping all
+    // chunks but the last one full. returns the entity that was moved, if any
+    Entity *remove(ArchetypeChunk *chunk, int row);
+
+    ArchetypeChunk *new_chunk();
+
+    ComponentMask _signature;
+    int capacity;
+    int num_fields;
+    int field_index[MAX_FIELDS];
+    int field_size[MAX_FIELDS];
+    int field_offset[MAX_FIELDS];
+    std::vector<ArchetypeChunk *> chunks;
+};
+
+
+// signature bit of an indexed component type (0 for other types)
+template <class T>
+inline ComponentMask component_mask() {
+    return T::INDEX != NO_INDEX ? (ComponentMask)1 << T::INDEX : 0;
+}
+
+// union of the signature bits of several component types
+template <class T, class U, class... Rest>
+inline ComponentMask component_mask() {
+    return component_mask<T>() | component_mask<U, Rest...>();
+}
+
+
 class Entity {
 public:
     Component *get_component(ComponentType type);
 
     template <class T>
     T *get_component() {
+        static_assert(T::INDEX < MAX_INDEXED_COMPONENTS, "component index out of range");
+        if (T::INDEX != NO_INDEX)
+            return static_cast<T *>(slots[T::INDEX]);
         return static_cast<T *>(get_component(T::TYPE));
     }
 
+    template <class T>
+    bool has_component() {
+        if (T::INDEX != NO_INDEX)
+            return (_signature & component_mask<T>()) != 0;
+        return get_component(T::TYPE) != nullptr;
+    }
+
+    // true if the entity has all the indexed components in mask
+    bool has_components(ComponentMask mask) {
+        return (_signature & mask) == mask;
+    }
+
+    ComponentMask signature() { return _signature; }
+
+    EntityHandle handle() { return _handle; }
+
+    // access a hot field stored in this entity's archetype chunk. only valid
+    // if a component that owns the field has been added
+    template <class T>
+    T &field(int f) {
+        assert(_chunk && _chunk->fields[f]);
+        return ((T *)_chunk->fields[f])[_row];
+    }
+
     // entities that are to be destroyed will live for exactly one frame
     // tith dying() == true, before being destroyed
     bool dying() { return _dying;  }
 
 private:
     friend class EntityManager;
+    friend class Component;
+    friend class EntityTemplate;
     template <class T> friend class IterablePool;
 
-    Entity() : _dying(false) {}
+    Entity() : _manager(nullptr), _dying(false), _signature(0), _chunk(nullptr), _row(0) {
+        for (int i = 0; i < MAX_INDEXED_COMPONENTS; ++i)
+            slots[i] = nullptr;
+    }
 
     struct ComponentHashKey {
         static unsigned int key(Component *c) { return c->type(); }
     };
     typedef FixedHashTable<3, Component *, ComponentHashKey> ComponentTable;
 
-    // We store component refs in an associative container that has the
+    // Components without a static index are not given a slot, so we store
+    // refs to them in an associative container that has the
     // structure of a linked list of fixed size hash tables using open
     // addressing scheme.
-    // We use universal hashing to ensure that most components fall into the
-    // exact bucket that their type hashes to, meaning that probe lengths are
-    // usually 0.
+    // The tables are given perfect hash functions (FixedHashTable::optimize),
+    // so that components fall into the exact bucket that their type hashes
+    // to, meaning that probe lengths are usually 0.
     // Chained blocks are independent, so lookup operations must try all
     // blocks until they find the type they are looking for, or fail.
     // Table size should be set so that only one or two blocks are needed
@@ -70,27 +254,272 @@ private:
         ComponentBlock(ComponentBlock *next = nullptr) : next(next) {}
     };
 
+    EntityManager *_manager;
     bool _dying;
+    EntityHandle _handle;
+    ComponentMask _signature; // bit i is set when slots[i] is occupied
+    Component *slots[MAX_INDEXED_COMPONENTS];
+    ArchetypeChunk *_chunk; // where our hot fields live, if we have any
+    int _row;
     ComponentBlock block; // an entity always has one embedded block
 };
 
 
+// A prefab listing the components of some kind of entity. The layout of
+// the entity (its signature, archetype and the hash function for any
+// unindexed components) is worked out when the first entity is spawned
+// from the template, and reused for every later one.
+class EntityTemplate {
+public:
+    EntityTemplate() : index(-1), hash_known(false) {}
+
+    template <class T>
+    void add() {
+        Entry entry = { &create<T>, &T::reserve, T::INDEX };
+        entries.push_back(entry);
+    }
+
+private:
+    friend class EntityManager;
+    friend class CommandBuffer;
+
+    template <class T>
+    static Component *create(EntityManager *m) {
+        return T::create(m);
+    }
+
+    struct Entry {
+        Component *(*create)(EntityManager *m);
+        void (*reserve)(EntityManager *m, int n);
+        int index;
+    };
+
+    std::vector<Entry> entries;
+    int index; // in EntityManager::templates, -1 until added
+    Entity::ComponentTable::HashFunction hash;
+    bool hash_known;
+};
+
+
+// Records structural changes (spawns, destroys, component adds/removes) so
+// that systems running on several threads can request them without touching
+// the pools. Each thread gets its own buffer from
+// EntityManager::command_buffer(), and all buffers are played back at the
+// start of EntityManager::update().
+//
+// Playback is ordered by key, then by recording order. Set the key to
+// something that identifies the work item (e.g. the handle index of the
+// entity being updated) and the result will not depend on how the work was
+// split across threads. Commands for entities which are gone by playback
+// time are dropped.
+//
+// Init callbacks are plain functions taking a payload, which is copied into
+// an arena along with the function pointer. Payloads are never destroyed,
+// so they must be trivially destructible (plain structs of values, handles
+// and pointers). Recording does not allocate once the buffers have grown.
+class CommandBuffer {
+public:
+    CommandBuffer() :
+        key(0),
+        arena0(1024*4, 150, "Command payloads"),
+        arena1(1024*4, 150, "Command payloads"),
+        payloads(&arena0),
+        replay_payloads(&arena1) {}
+
+    // applies to the commands recorded after it
+    void set_key(unsigned int k) { key = k; }
+
+    // spawn from t, which must have been added to the EntityManager
+    void spawn(EntityTemplate &t) {
+        assert(t.index >= 0 && "add the template to the EntityManager first");
+        push(SPAWN).tmpl = t.index;
+    }
+
+    // init(e, payload) is called on the main thread during playback, after
+    // the components are created and before the entity is initialized
+    template <class Payload>
+    void spawn(EntityTemplate &t, void (*init)(Entity *e, const Payload &p), const Payload &payload) {
+        spawn(t);
+        SpawnInit<Payload> bound = { init, payload };
+        bind(commands.back(), bound);
+    }
+
+    void destroy_entity(EntityHandle h) {
+        push(DESTROY).entity = h;
+    }
+
+    // the entity is skipped if it already has a T
+    template <class T>
+    void add_component(EntityHandle h) {
+        Command &cmd = push(ADD);
+        cmd.entity = h;
+        cmd.create = &create<T>;
+        cmd.type = T::TYPE;
+        cmd.index = T::INDEX;
+    }
+
+    // init(c, payload) is called before the component is initialized
+    template <class T, class Payload>
+    void add_component(EntityHandle h, void (*init)(T *c, const Payload &p), const Payload &payload) {
+        add_component<T>(h);
+        AddInit<T, Payload> bound = { init, payload };
+        bind(commands.back(), bound);
+    }
+
+    template <class T>
+    void del_component(EntityHandle h) {
+        Command &cmd = push(DEL);
+        cmd.entity = h;
+        cmd.type = T::TYPE;
+        cmd.index = T::INDEX;
+    }
+
+    bool empty() { return commands.empty(); }
+
+private:
+    friend class EntityManager;
+
+    enum Op { SPAWN, DESTROY, ADD, DEL };
+
+    template <class T>
+    static Component *create(EntityManager *m) {
+        return T::create(m);
+    }
+
+    // an init function and its payload, as stored in the arena
+    template <class Payload>
+    struct SpawnInit {
+        void (*init)(Entity *e, const Payload &p);
+        Payload payload;
+
+        static void call(Entity *e, const void *bound) {
+            const SpawnInit *b = (const SpawnInit *)bound;
+            b->init(e, b->payload);
+        }
+    };
+
+    template <class T, class Payload>
+    struct AddInit {
+        void (*init)(T *c, const Payload &p);
+        Payload payload;
+
+        static void call(Entity *e, const void *bound) {
+            const AddInit *b = (const AddInit *)bound;
+            b->init(e->get_component<T>(), b->payload);
+        }
+    };
+
+    struct Command {
+        Op op;
+        unsigned int key;
+        EntityHandle entity;
+        int tmpl;
+        Component *(*create)(EntityManager *m);
+        ComponentType type;
+        int index;
+        void (*init)(Entity *e, const void *bound); // null if there is none
+        const void *bound;
+    };
+
+    Command &push(Op op) {
+        Command cmd = {};
+        cmd.op = op;
+        cmd.key = key;
+        commands.push_back(cmd);
+        return commands.back();
+    }
+
+    template <class Bound>
+    void bind(Command &cmd, const Bound &bound) {
+        static_assert(std::is_trivially_destructible<Bound>::value, "payloads are never destroyed");
+        cmd.init = &Bound::call;
+        cmd.bound = payloads->alloc<Bound>(bound);
+    }
+
+    // commands and payloads trade places with the replay ones when played
+    // back, so recording can go on meanwhile
+    void begin_replay() {
+        replay.swap(commands);
+        std::swap(payloads, replay_payloads);
+    }
+
+    void end_replay() {
+        replay.clear();
+        replay_payloads->rewind();
+    }
+
+    unsigned int key;
+    std::vector<Command> commands;
+    std::vector<Command> replay; // commands being played back
+    Arena arena0;
+    Arena arena1;
+    Arena *payloads;
+    Arena *replay_payloads;
+};
+
+
 class EntityManager {
 public:
+    EntityManager();
     ~EntityManager();
 
+    // plays back the command buffers, then destroys dying entities
     void update();
 
+    // have run_frame() update s, after the systems scheduled before it
+    void schedule_system(System *s);
+
+    // Update the scheduled systems, then call update(). Each system waits
+    // for the earlier ones it conflicts with (see System::reads) and the
+    // rest run concurrently on pool. Without a pool they run in order.
+    void run_frame(float dt, ThreadPool *pool = nullptr);
+
+    // Heap allocations made during the last run_frame() by all threads, and
+    // by the update of scheduled system s. Always 0 unless allocations are
+    // counted (see util/allocstats.h). Once running steadily, a frame should
+    // not allocate at all.
+    unsigned int frame_allocations() { return last_frame_allocations; }
+    unsigned int system_allocations(System *s);
+
+    // the calling thread's command buffer. look it up once per system run
+    // rather than per entity, as this takes a lock
+    CommandBuffer *command_buffer();
+
     Entity *create_entity();
     void destroy_entity(Entity *e);
+
+    // null if the entity has been destroyed. entities that are dying are
+    // still returned, so check dying() if that matters
+    Entity *resolve(EntityHandle h) {
+        EntitySlot &slot = entity_slots[h.index()];
+        return slot.generation == h.generation() ? slot.entity : nullptr;
+    }
     void optimize_entity(Entity *e);
     void init_entity(Entity *e);
 
     void add_component(Entity *e, Component *c);
     void del_component(Entity *e, ComponentType type);
 
+    // Create count entities from a template. Storage for all of them is
+    // reserved up front, then for each entity the components are created,
+    // init(Entity *e, int i) is called to fill them in, and the entity is
+    // initialized (there is no need to call optimize_entity/init_entity).
+    template <class Func>
+    void spawn_batch(EntityTemplate &t, int count, Func init) {
+        reserve(t, count);
+        for (int i = 0; i < count; ++i) {
+            Entity *e = spawn(t);
+            init(e, i);
+            init_entity(e);
+        }
+    }
+
     System *get_system(SystemType type);
     void add_system(System *s);
+
+    // make t available to CommandBuffer::spawn. t must stay alive for as
+    // long as commands are played back
+    void add_template(EntityTemplate &t);
     void optimize_systems();
 
     template <class T>
@@ -102,7 +531,29 @@ public:
 
     template <class T>
     void del_component(Entity *e) {
-        del_component(e, T::TYPE);
+        if (T::INDEX != NO_INDEX)
+            del_indexed_component(e, T::INDEX);
+        else
+            del_component(e, T::TYPE);
+    }
+
+    // Register a hot field owned by the indexed component type C. Entities
+    // having C will store a T for the field in their archetype chunk.
+    // Fields must be registered before any components are added.
+    template <class C, class T>
+    void add_field(int field) {
+        static_assert(C::INDEX != NO_INDEX, "fields must be owned by an indexed component");
+        add_field(field, C::INDEX, sizeof(T));
+    }
+    void add_field(int field, int component_index, int size);
+
+    // call func for each chunk of entities having all the components in mask
+    template <class Func>
+    void for_each_chunk(ComponentMask mask, Func func) {
+        for (Archetype *a : archetype_list)
+        if ((a->signature() & mask) == mask)
+            for (ArchetypeChunk *c : *a)
+                func(c);
     }
 
     template <class T>
@@ -110,25 +561,330 @@ public:
         return static_cast<T *>(get_system(T::TYPE));
     }
 
+    // Call func(Ts *...) for every entity that has all of the pool allocated,
+    // indexed component types Ts. We walk the pool of whichever type has the
+    // fewest live components and use the entity signature to skip entities
+    // lacking any of the others, so there are no per-entity hash lookups.
+    // func must not add or remove components of the types being joined.
+    template <class... Ts, class Func>
+    void each(Func func);
+
+    // Like each(), but only for entities whose T has been touched after the
+    // change tick since, i.e. func(T *, Others *...) sees every change once
+    // if since is the value change_tick() returned on the previous run.
+    // Recent changes are looked up in a log, so unchanged entities cost
+    // nothing. If since is too old for the log, T's pool is scanned instead.
+    template <class T, class... Others, class Func>
+    void each_changed(unsigned int since, Func func);
+
+    // returns the current change tick and advances it, so that anything
+    // written from now on counts as changed after the returned value
+    unsigned int change_tick() {
+        return tick.fetch_add(1);
+    }
+
+    // the change logs are not locked, which is safe because systems that
+    // write the same type never run at the same time
+    void touch(Component *c) {
+        assert(may_touch(c) && "touched a component outside the system's writes()");
+        unsigned int t = tick.load(std::memory_order_relaxed);
+        if (c->version != t) {
+            c->version = t;
+            log_change(c);
+        }
+    }
+
+    // Pack entities and the components of every system into as few pool
+    // blocks as possible and free the rest. Worth calling now and then after
+    // lots of entities have died, as pools otherwise keep their peak size
+    // and get sparse. Entity and component pointers are invalidated (handles
+    // stay valid), so call this between frames, never from a system.
+    void compact();
+
+    // make the entity owning the component at from refer to it at to. for
+    // systems that move their components around
+    void relocate_component(Component *from, Component *to);
+
     IterablePool<Entity>::iterator begin() { return entity_pool.begin(); }
     IterablePool<Entity>::iterator end() { return entity_pool.end(); }
 
 private:
     void really_destroy_entity(Entity *e);
+    void reserve(EntityTemplate &t, int count);
+    Entity *spawn(EntityTemplate &t);
+    bool attach_component(Entity *e, Component *c);
     void add_component(Entity::ComponentBlock *block, Component *c);
+    void del_indexed_component(Entity *e, int index);
+    void update_archetype(Entity *e);
+    void remove_from_archetype(Entity *e);
+    EntityHandle alloc_handle(Entity *e);
+    void free_handle(EntityHandle h);
+    void log_change(Component *c);
+    bool may_touch(Component *c);
+    void trim_change_logs();
+    void relocate_entity(Entity *from, Entity *to);
+    void play_commands();
+    void play_command(const CommandBuffer::Command &cmd);
+    void run_scheduled(int i);
+    void update_scheduled(int i);
 
     struct SystemHashKey {
         static unsigned int key(System *c) { return c->type(); }
     };
     typedef FixedHashTable<8, System *, SystemHashKey> SystemTable;
 
-    MTRand_int32 rnd; // used to generate universal hash coefficients
     Pool<Entity::ComponentBlock> block_pool;
     IterablePool<Entity> entity_pool;
     SystemTable systems;
 
+    int field_sizes[MAX_FIELDS]; // 0 for unregistered fields
+    ComponentMask field_owners[MAX_FIELDS];
+    ComponentMask field_owner_mask; // union of field_owners
+    Archetype *archetypes[1 << MAX_INDEXED_COMPONENTS]; // indexed by signature
+    std::vector<Archetype *> archetype_list;
+
+    // handle index -> entity. free slots are kept in a FIFO list threaded
+    // through next_free, so that a slot is reused (and its generation
+    // bumped) as rarely as possible
+    struct EntitySlot {
+        Entity *entity;
+        unsigned int generation;
+        unsigned int next_free;
+    };
+    std::vector<EntitySlot> entity_slots;
+    unsigned int free_head;
+    unsigned int free_tail;
+
+    // For each indexed component type, the entities whose component of that
+    // type was touched, in increasing tick order. An entity is logged at most
+    // once per tick. Entries older than CHANGE_LOG_FRAMES calls to update()
+    // are dropped, and log_start_tick is the oldest tick still complete.
+    enum { CHANGE_LOG_FRAMES = 4 };
+    struct ChangeEntry {
+        EntityHandle entity;
+        unsigned int tick;
+
+        bool operator<(unsigned int t) const { return tick < t; }
+    };
+    std::vector<ChangeEntry> change_logs[MAX_INDEXED_COMPONENTS];
+    std::atomic<unsigned int> tick;
+    unsigned int log_start_tick;
+    unsigned int frame_ticks[CHANGE_LOG_FRAMES];
+    unsigned int frame_count;
+
     std::vector<Entity *> kill_next_time;
     std::vector<Entity *> kill_this_time;
+
+    // buffers in creation order, which breaks ties between equal keys
+    std::mutex command_mutex;
+    std::vector<std::pair<std::thread::id, CommandBuffer *> > command_buffers;
+    struct PlaybackEntry {
+        unsigned int key;
+        unsigned int order; // by buffer, then recording order
+        const CommandBuffer::Command *cmd;
+
+        bool operator<(const PlaybackEntry &other) const {
+            return key != other.key ? key < other.key : order < other.order;
+        }
+    };
+    std::vector<PlaybackEntry> playback;
+    std::vector<EntityTemplate *> templates;
+    std::vector<int> spawn_counts; // by template, for reserving before playback
+    std::vector<CommandBuffer *> replaying;
+
+    // systems in schedule order, each with the later systems that conflict
+    // with it and so have to wait for it
+    struct ScheduledSystem {
+        System *system;
+        ComponentMask reads;
+        ComponentMask writes;
+        std::vector<int> dependents;
+        int num_dependencies;
+        unsigned int allocations; // during the last update
+    };
+    std::vector<ScheduledSystem> schedule;
+    std::mutex schedule_mutex;
+    unsigned int last_frame_allocations;
+
+    // state of the run_frame() in progress. kept here rather than captured
+    // so that pool tasks fit in std::function without allocating
+    std::vector<int> remaining_dependencies;
+    float frame_dt;
+    ThreadPool *frame_pool;
+    ThreadPool::Group *frame_group;
 };
 
+
+inline void Component::touch() {
+    assert(entity);
+    entity->_manager->touch(this);
+}
+
+
+// Owns the components of type T, in a pool of type PoolT. Use
+// ConcurrentPool<T> (util/concurrentpool.h) for components that are created
+// and destroyed from several threads at once.
+template <class T, SystemType Type, class PoolT = IterablePool<T> >
+class PoolSystem : public System {
+public:
+    enum { TYPE = Type };
+    SystemType type() override { return TYPE; }
+
+    // the arguments are passed on to the pool, e.g. an IterablePool's
+    // initial size, block size and HugePageSlab
+    template <class... Args>
+    explicit PoolSystem(Args&&... args) : pool(std::forward<Args>(args)...) {
+        pool.set_name(type_name());
+    }
+
+    T *create_component() {
+        return pool.create();
+    }
+
+    void destroy_component(T *c) {
+        pool.free(c);
+    }
+
+    int size() { return pool.size(); }
+    void reserve(int n) { pool.reserve(n); }
+
+    typename PoolT::iterator begin() { return pool.begin(); }
+    typename PoolT::iterator end() { return pool.end(); }
+
+    // func(T *components, int n) for each run of adjacent live components
+    template <class Func>
+    void for_each_span(Func func) { pool.for_each_span(func); }
+
+    void compact(EntityManager *m) override {
+        pool.compact([m](T *from, T *to) { m->relocate_component(from, to); });
+    }
+
+protected:
+    PoolT pool;
+
+private:
+    // the type code as a string, to name the pool in the memory stats
+    static const char *type_name() {
+        static char name[5];
+        for (int i = 0; i < 4; ++i)
+            name[i] = (char)(Type >> (24 - 8*i));
+        return name;
+    }
+};
+
+
+template <class T, ComponentType Type, int Index, class SystemT>
+struct PoolComponent : public Component {
+    enum { TYPE = Type, INDEX = Index };
+    typedef SystemT PoolSystemType;
+
+    ComponentType type() override { return TYPE; }
+    int index() override { return INDEX; }
+
+    static T *create(EntityManager *m) {
+        SystemT *sys = m->get_system<SystemT>();
+        return sys->create_component();
+    }
+
+    static void reserve(EntityManager *m, int n) {
+        SystemT *sys = m->get_system<SystemT>();
+        sys->reserve(n);
+    }
+
+    void destroy(EntityManager *m) override {
+        SystemT *sys = m->get_system<SystemT>();
+        sys->destroy_component(static_cast<T *>(this));
+    }
+};
+
+
+// implementation of EntityManager::each
+template <class... Ts>
+struct ComponentJoin {
+    template <int I, class... Us>
+    struct Smallest {
+        static void find(EntityManager *m, int &best, int &best_size) {}
+    };
+
+    template <int I, class U, class... Us>
+    struct Smallest<I, U, Us...> {
+        static void find(EntityManager *m, int &best, int &best_size) {
+            static_assert(U::INDEX != NO_INDEX, "only indexed component types can be joined");
+            int size = m->get_system<typename U::PoolSystemType>()->size();
+            if (best < 0 || size < best_size) {
+                best = I;
+                best_size = size;
+            }
+            Smallest<I + 1, Us...>::find(m, best, best_size);
+        }
+    };
+
+    template <int I, class... Us>
+    struct Walk {
+        template <class Func>
+        static void run(EntityManager *m, int which, Func &func) {}
+    };
+
+    template <int I, class U, class... Us>
+    struct Walk<I, U, Us...> {
+        template <class Func>
+        static void run(EntityManager *m, int which, Func &func) {
+            if (which != I) {
+                Walk<I + 1, Us...>::run(m, which, func);
+                return;
+            }
+            ComponentMask mask = component_mask<Ts...>();
+            for (U *c : *m->get_system<typename U::PoolSystemType>()) {
+                Entity *e = c->entity;
+                if (e->has_components(mask))
+                    func(e->get_component<Ts>()...);
+            }
+        }
+    };
+
+    template <class Func>
+    static void run(EntityManager *m, Func &func) {
+        int best = -1;
+        int best_size = 0;
+        Smallest<0, Ts...>::find(m, best, best_size);
+        if (best_size > 0)
+            Walk<0, Ts...>::run(m, best, func);
+    }
+};
+
+template <class... Ts, class Func>
+void EntityManager::each(Func func) {
+    static_assert(sizeof...(Ts) > 0, "need at least one component type");
+    ComponentJoin<Ts...>::run(this, func);
+}
+
+template <class T, class... Others, class Func>
+void EntityManager::each_changed(unsigned int since, Func func) {
+    static_assert(T::INDEX != NO_INDEX, "changes are only tracked for indexed components");
+    ComponentMask mask = component_mask<T, Others...>();
+
+    if (since + 1 < log_start_tick) {
+        for (T *c : *get_system<typename T::PoolSystemType>()) {
+            Entity *e = c->entity;
+            if (c->version > since && e->has_components(mask))
+                func(c, e->get_component<Others>()...);
+        }
+        return;
+    }
+
+    std::vector<ChangeEntry> &log = change_logs[T::INDEX];
+    size_t i = std::lower_bound(log.begin(), log.end(), since + 1) - log.begin();
+    size_t n = log.size(); // ignore changes made by func itself
+    for (; i < n; ++i) {
+        ChangeEntry entry = log[i];
+        Entity *e = resolve(entry.entity);
+        if (!e || !e->has_components(mask))
+            continue;
+        T *c = e->get_component<T>();
+        if (c->version != entry.tick)
+            continue; // touched again later, so there is a newer entry
+        func(c, e->get_component<Others>()...);
+    }
+}
+
 #endif
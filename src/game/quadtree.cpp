@@ -33,6 +33,7 @@ void QuadTree::Object::qtree_update() {
 
 
 QuadTree::QuadTree(float x0, float y0, float x1, float y1, int max_depth) : max_depth(max_depth) {
+    pool.set_name("QuadTree::Node");
     root = new_node(nullptr, x0, y0, x1, y1);
 }
 
@@ -3,6 +3,7 @@
 
 #include "util/list.h"
 #include "util/pool.h"
+#include <utility>
 
 class QuadTree {
     class Node;
@@ -13,6 +14,11 @@ public:
         Object() : qtree_node(nullptr) {}
         virtual ~Object() { qtree_remove(); }
 
+        // the moved-to object takes the place of obj in the tree
+        Object(Object &&obj) : qtree_node(obj.qtree_node), qtree_link(std::move(obj.qtree_link)) {
+            obj.qtree_node = nullptr;
+        }
+
         void qtree_remove();
         void qtree_update(); // call after position has changed
 
@@ -30,6 +36,9 @@ public:
     void insert(Object *obj);
     void remove(Object *obj);
 
+    // give node storage that is no longer needed back to the system
+    void trim() { pool.trim(); }
+
     template <class Func>
     void query(float x0, float y0, float x1, float y1, Func func) {
         root->query(x0, y0, x1, y1, func);
@@ -34,7 +34,6 @@
 
 namespace RVO {
     const float RVO_EPSILON = 0.00001f;
-    const size_t MAX_PLANES = 128;
 
     class Line {
     public:
@@ -247,14 +246,16 @@ namespace RVO {
      * \param   beginPlane The plane on which the 3-d linear program failed.
      * \param   radius     The radius of the spherical constraint.
      * \param   result     A reference to the result of the linear program.
+     * \param   scratch    Arena for the projected planes.
      */
-    void linearProgram4(const Plane planes[], size_t planeCount, size_t beginPlane, float radius, Vector3 &result) {
+    void linearProgram4(const Plane planes[], size_t planeCount, size_t beginPlane, float radius, Vector3 &result, Arena &scratch) {
         float distance = 0.0f;
 
         for (size_t i = beginPlane; i < planeCount; ++i) {
             if (planes[i].normal * (planes[i].point - result) > distance) {
                 /* Result does not satisfy constraint of plane i. */
-                Plane projPlanes[MAX_PLANES];
+                ArenaMarker marker(scratch);
+                Plane *projPlanes = scratch.alloc_array<Plane>((int)i);
                 size_t projPlanesCount = 0;
 
                 for (size_t j = 0; j < i; ++j) {
@@ -293,11 +294,9 @@ namespace RVO {
         }
     }
 
-    Vector3 Agent::computeNewVelocity(float timeStep, float timeHorizon, Vector3 prefVelocity, float maxSpeed, const Agent* neighbors[], size_t neighborCount) {
-        Plane orcaPlanes[MAX_PLANES];
-        if (neighborCount > MAX_PLANES) {
-            neighborCount = MAX_PLANES;
-        }
+    Vector3 Agent::computeNewVelocity(float timeStep, float timeHorizon, Vector3 prefVelocity, float maxSpeed, const Agent* neighbors[], size_t neighborCount, Arena &scratch) {
+        ArenaMarker marker(scratch);
+        Plane *orcaPlanes = scratch.alloc_array<Plane>((int)neighborCount);
         const float invTimeHorizon = 1.0f / timeHorizon;
 
         /* Create agent ORCA planes. */
@@ -359,7 +358,7 @@ namespace RVO {
         const size_t planeFail = linearProgram3(orcaPlanes, neighborCount, maxSpeed, prefVelocity, false, newVelocity);
 
         if (planeFail < neighborCount) {
-            linearProgram4(orcaPlanes, neighborCount, planeFail, maxSpeed, newVelocity);
+            linearProgram4(orcaPlanes, neighborCount, planeFail, maxSpeed, newVelocity, scratch);
         }
 
         return newVelocity;
@@ -34,6 +34,7 @@
 #define RVO_AGENT_H_
 
 #include <cmath>
+#include "util/arena.h"
 
 namespace RVO {
     class Vector3 {
@@ -72,7 +73,8 @@ namespace RVO {
         Agent() : radius(0.0f) { }
         Agent(Vector3 position, Vector3 velocity, float radius) : position(position), velocity(velocity), radius(radius) { }
 
-        Vector3 computeNewVelocity(float timeStep, float timeHorizon, Vector3 prefVelocity, float maxSpeed, const Agent* neighbors[], size_t neighborCount);
+        /* Temporary plane arrays are allocated from scratch and freed again before returning. */
+        Vector3 computeNewVelocity(float timeStep, float timeHorizon, Vector3 prefVelocity, float maxSpeed, const Agent* neighbors[], size_t neighborCount, Arena &scratch);
     };
 }
 
@@ -0,0 +1,618 @@
+#include "game/world.h"
+
+#include <glm/gtc/quaternion.hpp>
+#include <glm/gtc/matrix_inverse.hpp>
+#include <glm/gtc/random.hpp>
+#include <glm/gtx/transform.hpp>
+#include <glm/gtx/vector_angle.hpp>
+
+#include <cstdlib>
+#include <algorithm>
+
+
+static RVO::Vector3 to_rvo(vec3 v) {
+    return RVO::Vector3(v.x, v.y, v.z);
+}
+
+static vec3 from_rvo(RVO::Vector3 v) {
+    return vec3(v.x, v.y, v.z);
+}
+
+static mat4 calc_rotation_matrix(vec3 dir) {
+    vec3 up(0, 0, 1);
+    vec3 forward(glm::normalize(dir));
+    vec3 right(glm::cross(forward, up));
+    up = glm::cross(right, forward);
+    right = glm::normalize(glm::cross(forward, up));
+    up = glm::normalize(glm::cross(right, forward));
+
+    mat4 m;
+    m[0] = vec4(right, 0);
+    m[1] = vec4(forward, 0);
+    m[2] = vec4(up, 0);
+    return m;
+}
+
+void Body::init(EntityManager *m, Entity *e) {
+    BodySystem *sys = m->get_system<BodySystem>();
+    sys->quad_tree.insert(this);
+
+    rvo_agent = new RVO::Agent;
+    rvo_agent->position = to_rvo(pos());
+    rvo_agent->radius = radius();
+    rvo_agent->velocity = RVO::Vector3();
+}
+
+ComponentMask BodySystem::reads() {
+    return component_mask<Body, Ship>();
+}
+
+ComponentMask BodySystem::writes() {
+    return component_mask<Body, SimpleRenderable>();
+}
+
+void BodySystem::update(EntityManager *m, float dt) {
+    // only bodies which moved since last time, so asteroids are free
+    unsigned int now = m->change_tick();
+
+    // ShipSystem moves ships by writing the chunk arrays, so the agents
+    // are brought up to date here
+    m->each_changed<Body>(last_tick, [](Body *b) {
+        b->qtree_update();
+        b->rvo_agent->position = to_rvo(b->pos());
+    });
+
+    // a ship can turn without moving, so changes to either count. those
+    // with a changed body were handled by the first pass
+    unsigned int since = last_tick;
+    m->each_changed<Body, Ship, SimpleRenderable>(since, [](Body *b, Ship *s, SimpleRenderable *r) {
+        r->model_matrix = glm::translate(b->pos()) * calc_rotation_matrix(s->dir());
+    });
+    m->each_changed<Ship, Body, SimpleRenderable>(since, [since](Ship *s, Body *b, SimpleRenderable *r) {
+        if (b->version <= since)
+            r->model_matrix = glm::translate(b->pos()) * calc_rotation_matrix(s->dir());
+    });
+
+    last_tick = now;
+}
+
+void BodySystem::compact(EntityManager *m) {
+    PoolSystem::compact(m);
+    quad_tree.trim();
+}
+
+static float adjust_query_radius(float radius, int num_found, int maximum) {
+    if (num_found < maximum) radius += 0.1f;
+    else if (num_found > maximum) radius -= 0.1f;
+    return clamp(radius, 1.0f, 50.0f);
+}
+
+static bool sweep(Body *b0, Body *b1, float dt, float &t_out) {
+    glm::vec3 v0 = b1->pos() - b0->pos();
+    glm::vec3 v1 = v0 + (b1->vel() - b0->vel())*dt;
+    float r = (b0->radius() + b1->radius());
+
+    float dot00 = glm::dot(v0, v0);
+    float dot01 = glm::dot(v0, v1);
+    float dot11 = glm::dot(v1, v1);
+
+    float a = dot00 - 2.f * dot01 + dot11;
+    float b = 2.f * (dot01 - dot00);
+    float c = dot00 - r*r;
+
+    float det = b*b - 4.f * a*c;
+
+    if (det > 0.f) {
+        float t = -(b + sqrtf(det)) / (2.f * a);
+        if (0.f <= t && t <= 1.f) {
+            t_out = t;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+vec3 limit(vec3 v, float len) {
+    if (glm::length(v) > len)
+        return glm::normalize(v) * len;
+    return v;
+}
+
+void Ship::init(EntityManager *m, Entity *e) {
+    assert(e->get_component<Body>());
+}
+
+// turn dir towards vel by at most max_angle
+static vec3 turn_towards(vec3 dir, vec3 vel, float max_angle) {
+    float len = glm::length(vel);
+    if (len > 0) {
+        vec3 v = vel / len;
+        float a = glm::angle(dir, v);
+        if (fabsf(a) > 0.001f) {
+            vec3 axis(glm::cross(dir, v));
+            return glm::normalize(dir * glm::angleAxis(glm::min(max_angle, a), axis));
+        }
+    }
+    return dir;
+}
+
+void ShipSystem::update(EntityManager *m, float dt) {
+    // steering picks new velocities
+    for_each_span([=](Ship *ships, int n) {
+        for (int i = 0; i < n; ++i)
+            ships[i].update(m, dt);
+    });
+
+    // then everything moves at once, straight over the chunk arrays. Ship
+    // and Body were both touched by Ship::update, so these writes need not be
+    m->for_each_chunk(component_mask<Body, Ship>(), [=](ArchetypeChunk *c) {
+        vec3 *pos = c->field<vec3>(POS_FIELD);
+        const vec3 *vel = c->field<vec3>(VEL_FIELD);
+        vec3 *dir = c->field<vec3>(DIR_FIELD);
+        for (int i = 0; i < c->count; ++i) {
+            pos[i] += vel[i] * dt;
+            dir[i] = turn_towards(dir[i], vel[i], 45.0f * dt);
+        }
+    });
+}
+
+void Ship::update(EntityManager *m, float dt) {
+    BodySystem *sys = m->get_system<BodySystem>();
+    ShipSystem *ships = m->get_system<ShipSystem>();
+    World *world = ships->world;
+
+    int num_friends = 0;
+    int num_closest = 0;
+    friends.clear();
+    closest.clear();
+
+    float friend_radius_squared = friend_radius*friend_radius;
+    float closest_radius_squared = closest_radius*closest_radius;
+    float query_radius = std::max(friend_radius, closest_radius);
+    
+    vec2 p(body()->pos());
+
+    sys->quad_tree.query(p.x - query_radius, p.y - query_radius,
+                         p.x + query_radius, p.y + query_radius,
+                         [&](QuadTree::Object *obj) mutable
+    {
+        Body *b = static_cast<Body *>(obj);
+        if (b == body())
+            return;
+        vec2 d = vec2(b->pos()) - p;
+        float dist_squared = d.x*d.x + d.y*d.y;
+
+        if (dist_squared <= friend_radius_squared) {
+            Ship *s = b->entity->get_component<Ship>();
+            if (s && s->team == team) {
+                if (!friends.full())
+                    friends.push_back(b->entity->handle());
+                num_friends++;
+            }
+        }
+
+        if (dist_squared <= closest_radius_squared) {
+            if (!closest.full())
+                closest.push_back(b->entity->handle());
+            num_closest++;
+        }
+    });
+
+    friend_radius = adjust_query_radius(friend_radius, num_friends, MAX_FRIENDS);
+    closest_radius = adjust_query_radius(closest_radius, num_closest, MAX_CLOSEST);
+
+    vec3 acc(0, 0, 0);
+
+    //acc = obstacle_avoid(m);
+
+    //if (acc == vec3(0, 0, 0)) {
+    acc += separation(m) * 1.5f;
+    acc += alignment(m) * 1.0f;
+    acc += cohesion(m) * 1.0f;
+
+    acc += planehug() * 1.5f;
+    //acc += zseparation(m) * 1.5f;
+
+    acc += arrive(world->cursor_pos) * 1.5f;
+    //}
+
+    vec3 desired_vel = limit(body()->vel() + acc * dt, maxspeed);
+
+
+    body()->agentNeighbors.clear();
+    float rvo_radius = 50.0;
+    float rvo_radius_sqr = rvo_radius * rvo_radius;
+    sys->quad_tree.query(p.x - rvo_radius, p.y - rvo_radius,
+                         p.x + rvo_radius, p.y + rvo_radius,
+                         [&](QuadTree::Object *obj) mutable
+    {
+        body()->insertAgentNeighbor(static_cast<Body *>(obj)->rvo_agent, Body::MAX_AGENT_NEIGHBORS, rvo_radius_sqr);
+    });
+    ArenaMarker marker(ships->scratch);
+    int num_neighbors = (int)body()->agentNeighbors.size();
+    const RVO::Agent **neighbors = ships->scratch.alloc_array<const RVO::Agent *>(num_neighbors);
+    for (int i = 0; i < num_neighbors; ++i)
+        neighbors[i] = body()->agentNeighbors[i].second;
+    RVO::Agent *agent = body()->rvo_agent;
+    agent->velocity = agent->computeNewVelocity(dt, 10.0, to_rvo(desired_vel), maxspeed, neighbors, num_neighbors, ships->scratch);
+    body()->set_vel(from_rvo(agent->velocity));
+    touch(); // the neighbors changed, and ShipSystem::update turns us
+}
+
+vec3 Ship::planehug() {
+    vec3 target = body()->pos();
+    target.z = 0;
+    return arrive(target);
+}
+
+vec3 Ship::zseparation(EntityManager *m) {
+    float sep = 20.0f;
+    vec3 sum(0, 0, 0);
+    int count = 0;
+    for (EntityHandle h : closest) {
+        Entity *e = m->resolve(h);
+        if (!e) continue;
+
+        Body *b = e->get_component<Body>();
+        vec3 d = body()->pos() - b->pos();
+        float len = glm::length(d);
+        if (len > sep || len <= 0.00001f) continue;
+        //d = glm::normalize(d);
+        float dz = d.z;
+        if (dz == 0.0f)
+            dz = glm::dot(glm::normalize(body()->vel()), glm::normalize(b->vel()));
+        dz /= fabsf(dz);
+        dz /= len;
+        sum += vec3(0, 0, dz);
+        ++count;
+    }
+    if (count == 0)
+        return vec3(0, 0, 0);
+    sum /= (float)count;
+    return steer(sum);
+}
+
+vec3 Ship::separation(EntityManager *m) {
+    float sep = 20.0f;
+    vec3 sum(0, 0, 0);
+    int count = 0;
+    for (EntityHandle h : closest) {
+        Entity *e = m->resolve(h);
+        if (!e) continue;
+
+        Body *b = e->get_component<Body>();
+        vec3 d = body()->pos() - b->pos();
+        //d.z = 0;
+        float len = glm::length(d);
+        if (len > sep || len <= 0.00001f) continue;
+        d = glm::normalize(d);
+        d /= len;
+        sum += d;
+        ++count;
+    }
+    if (count == 0)
+        return vec3(0, 0, 0);
+    sum /= (float)count;
+    return steer(sum);
+}
+
+vec3 Ship::obstacle_avoid(EntityManager *m) {
+    std::vector<LineVertex> &line_vertexes = m->get_system<ShipSystem>()->world->line_vertexes;
+    float t_horizon = 5.0f;
+    float best_t = 10000000.0f;
+    Body *best_b = nullptr;
+
+    vec3 sum(0, 0, 0);
+
+    for (EntityHandle h : closest) {
+        Entity *e = m->resolve(h);
+        if (!e) continue;
+
+        Body *b = e->get_component<Body>();
+
+        float t = 0.0f;
+        if (sweep(body(), b, t_horizon, t)) {
+            vec3 p0 = body()->pos() + body()->vel()*t*t_horizon;
+            vec3 p1 = b->pos() + b->vel()*t*t_horizon;
+            sum += glm::normalize(p0 - p1) * (1.0f - t);
+
+            line_vertexes.push_back(LineVertex(body()->pos(), vec4(0, 1, 0, 0.9f)));
+            line_vertexes.push_back(LineVertex(b->pos(), vec4(0, 1, 0, 0.1f)));
+
+            line_vertexes.push_back(LineVertex(body()->pos(), vec4(0, 0, 1, 1)));
+            line_vertexes.push_back(LineVertex(p0, vec4(0, 0, 1, 1)));
+
+            line_vertexes.push_back(LineVertex(b->pos(), vec4(1, 0, 0, 1)));
+            line_vertexes.push_back(LineVertex(p1, vec4(1, 0, 0, 1)));
+
+            if (t < best_t) {
+                best_t = t;
+                best_b = b;
+            }
+        }
+    }
+
+    if (!best_b)
+        return vec3(0, 0, 0);
+
+    //vec3 v = steer(glm::cross(body()->vel(), body()->pos() - best_b->pos()));
+    vec3 v = steer(sum);
+
+    line_vertexes.push_back(LineVertex(body()->pos(), vec4(1, 1, 1, 0.8f)));
+    line_vertexes.push_back(LineVertex(body()->pos() + v*3.0f, vec4(1, 1, 1, 0.8f)));
+
+    return v;
+}
+
+vec3 Ship::alignment(EntityManager *m) {
+    float neighbordist = 50;
+    vec3 sum(0, 0, 0);
+    int count = 0;
+    for (EntityHandle h : friends) {
+        Entity *e = m->resolve(h);
+        if (!e) continue;
+
+        Body *b = e->get_component<Body>();
+        Ship *s = e->get_component<Ship>();
+        if (s->team != team) continue;
+        
+        vec3 d = body()->pos() - b->pos();
+        float dist = glm::length(d);
+        if (dist > neighbordist) continue;
+        sum += b->vel();
+        ++count;
+    }
+    if (count == 0)
+        return vec3(0, 0, 0);
+    sum /= (float)count;
+    return steer(sum);
+}
+
+vec3 Ship::cohesion(EntityManager *m) {
+    float neighbordist = 50;
+    vec3 sum(0, 0, 0);
+    int count = 0;
+    for (EntityHandle h : friends) {
+        Entity *e = m->resolve(h);
+        if (!e) continue;
+
+        Body *b = e->get_component<Body>();
+        Ship *s = e->get_component<Ship>();
+        if (s->team != team) continue;
+        
+        vec3 d = body()->pos() - b->pos();
+        float len = glm::length(d);
+        if (len > neighbordist) continue;
+        sum += b->pos();
+        ++count;
+    }
+    if (count == 0)
+        return vec3(0, 0, 0);
+    sum /= (float)count;
+    return seek(sum);
+}
+
+vec3 Ship::seek(vec3 target) {
+    return steer(target - body()->pos());
+}
+
+vec3 Ship::steer(vec3 dir) {
+    float len = glm::length(dir);
+    if (len < 0.000001f)
+        return vec3(0, 0, 0);
+    dir *= maxspeed / len;
+    return limit(dir - body()->vel(), maxforce);
+}
+
+vec3 Ship::arrive(vec3 target) {
+    float brakelimit = 50.0f;
+    vec3 desired = target - body()->pos();
+    float len = glm::length(desired);
+    if (len < 0.000001f)
+        return vec3(0, 0, 0);
+    desired /= len;
+    if (len < brakelimit) {
+        desired *= (len / brakelimit) * maxspeed;
+    } else {
+        desired *= maxspeed;
+    }
+    return limit(desired, maxforce);
+}
+
+
+
+// the planes of the view frustum of pv, normals pointing inwards
+static void frustum_planes(const mat4 &pv, vec4 planes[6]) {
+    vec4 rows[4];
+    for (int i = 0; i < 4; ++i)
+        rows[i] = vec4(pv[0][i], pv[1][i], pv[2][i], pv[3][i]);
+    for (int i = 0; i < 3; ++i) {
+        planes[i*2] = rows[3] + rows[i];
+        planes[i*2 + 1] = rows[3] - rows[i];
+    }
+    for (int i = 0; i < 6; ++i)
+        planes[i] /= glm::length(vec3(planes[i]));
+}
+
+void SimpleRenderableSystem::render(EntityManager *m, RenderQueue *renderqueue, mat4 view_matrix, mat4 projection_matrix) {
+    vec4 planes[6];
+    frustum_planes(projection_matrix * view_matrix, planes);
+
+    m->each<Body, SimpleRenderable>([&](Body *b, SimpleRenderable *r) {
+        // meshes are drawn unscaled or scaled to the body, so the larger
+        // radius bounds both
+        vec3 p = b->pos();
+        float radius = std::max(b->radius(), r->mesh->radius());
+        for (int i = 0; i < 6; ++i)
+        if (glm::dot(vec3(planes[i]), p) + planes[i].w < -radius)
+            return;
+
+        mat4 vm = view_matrix * r->model_matrix;
+        mat4 pvm = projection_matrix * vm;
+        mat3 normal = glm::inverseTranspose(mat3(vm));
+
+        auto cmd = renderqueue->add_command(r->material, r->mesh);
+        cmd->add_uniform("m_pvm", pvm);
+        cmd->add_uniform("m_vm", vm);
+        cmd->add_uniform("m_normal", normal);
+    });
+}
+
+
+
+static Material::Ref make_material(Program::Ref program, vec4 ambient, vec4 diffuse, vec4 specular, float shininess) {
+    Material::Ref material = Material::create(program);
+    material->set("mat_ambient", ambient);
+    material->set("mat_diffuse", diffuse);
+    material->set("mat_specular", specular);
+    material->set("mat_shininess", shininess);
+    return material;
+}
+
+void WorldAssets::create_materials(Program::Ref program) {
+    team_materials[0] = make_material(program,
+        vec4(0.25f, 0.25f, 0.25f, 1),
+        vec4(0.4f, 0.4f, 0.4f, 1),
+        vec4(0.774597f, 0.774597f, 0.774597f, 1),
+        76.8f);
+    team_materials[1] = make_material(program,
+        vec4(0.329412f, 0.223529f, 0.027451f, 1.0f),
+        vec4(0.780392f, 0.568627f, 0.113725f, 1.0f),
+        vec4(0.992157f, 0.941176f, 0.807843f, 1.0f),
+        27.89743616f);
+    asteroid_material = make_material(program,
+        vec4(0.15f, 0.15f, 0.15f, 1),
+        vec4(0.3f, 0.3f, 0.3f, 1),
+        vec4(0.4f, 0.4f, 0.4f, 1),
+        56.8f);
+}
+
+World::World(const WorldAssets &assets) :
+    assets(assets),
+    ships(this),
+    update_dt(0),
+    update_pool(nullptr)
+{
+    entities.add_system(&bodies);
+    entities.add_system(&ships);
+    entities.add_system(&renderables);
+    entities.optimize_systems();
+    entities.add_field<Body, vec3>(POS_FIELD);
+    entities.add_field<Body, vec3>(VEL_FIELD);
+    entities.add_field<Body, float>(RADIUS_FIELD);
+    entities.add_field<Ship, vec3>(DIR_FIELD);
+    entities.schedule_system(&ships);
+    entities.schedule_system(&bodies);
+
+    boid_template.add<Body>();
+    boid_template.add<Ship>();
+    boid_template.add<SimpleRenderable>();
+
+    asteroid_template.add<Body>();
+    asteroid_template.add<SimpleRenderable>();
+
+    entities.add_template(boid_template);
+    entities.add_template(asteroid_template);
+}
+
+void World::update(float dt, ThreadPool *pool) {
+    entities.run_frame(dt, pool);
+}
+
+void World::update_all(const std::vector<World *> &worlds, float dt, ThreadPool *pool) {
+    ThreadPool::Group group;
+    for (World *w : worlds) {
+        w->update_dt = dt;
+        w->update_pool = pool;
+        pool->submit(group, [w]() { w->update(w->update_dt, w->update_pool); });
+    }
+    pool->wait(group);
+}
+
+void World::spawn_boid(vec3 pos) {
+    SpawnAt at = { this, pos };
+    entities.command_buffer()->spawn(boid_template, &World::init_boid, at);
+}
+
+void World::spawn_asteroid(vec3 pos) {
+    SpawnAt at = { this, pos };
+    entities.command_buffer()->spawn(asteroid_template, &World::init_asteroid, at);
+}
+
+void World::spawn_boids(int count, float radius) {
+    CommandBuffer *commands = entities.command_buffer();
+    for (int i = 0; i < count; ++i) {
+        SpawnAt at = { this, vec3(glm::diskRand(radius), 0.0f) };
+        commands->spawn(boid_template, &World::init_boid, at);
+    }
+}
+
+void World::spawn_asteroids(int count, float radius) {
+    CommandBuffer *commands = entities.command_buffer();
+    for (int i = 0; i < count; ++i) {
+        SpawnAt at = { this, vec3(glm::diskRand(radius), 0.0f) };
+        commands->spawn(asteroid_template, &World::init_asteroid, at);
+    }
+}
+
+void World::init_boid(Entity *e, const SpawnAt &at) {
+    const WorldAssets &assets = at.world->assets;
+    vec3 pos = at.pos;
+    pos.z = glm::linearRand(-10.0f, 10.0f);
+
+    Body *b = e->get_component<Body>();
+    b->set_pos(pos);
+    b->set_radius(assets.ship_mesh->radius() * .5f);
+
+    Ship *s = e->get_component<Ship>();
+    s->set_dir(glm::normalize(vec3(glm::diskRand(10.0f), 0.0f)));
+    s->maxspeed = glm::linearRand(10.0f, 30.0f);
+    s->maxforce = glm::linearRand(0.5f, 2.0f);
+    s->team = rand() % 2;
+    
+    SimpleRenderable *r = e->get_component<SimpleRenderable>();
+    r->mesh = assets.ship_mesh;
+    r->material = assets.team_materials[s->team];
+}
+
+void World::init_asteroid(Entity *e, const SpawnAt &at) {
+    const WorldAssets &assets = at.world->assets;
+    vec3 pos = at.pos;
+    pos.z = glm::linearRand(-10.0f, 10.0f);
+
+    Body *b = e->get_component<Body>();
+    b->set_pos(pos);
+    b->set_radius(assets.asteroid_mesh->radius() * 10);
+
+    SimpleRenderable *r = e->get_component<SimpleRenderable>();
+    r->model_matrix = glm::translate(pos) * glm::scale(vec3(10, 10, 10));
+    r->mesh = assets.asteroid_mesh;
+    r->material = assets.asteroid_material;
+}
+
+Entity *World::closest_to(vec3 p) {
+    Body *best = nullptr;
+    float best_dist = 100000.0f;
+
+    bodies.quad_tree.query(p.x - 50, p.y - 50,
+                           p.x + 50, p.y + 50,
+                         [&](QuadTree::Object *obj) mutable
+    {
+        Body *b = static_cast<Body *>(obj);
+        if (!best) {
+            best = b;
+        } else {
+            vec3 d = b->pos() - p;
+            float dist = glm::length(d);
+            if (dist < best_dist) {
+                best = b;
+                best_dist = dist;
+            }
+        }
+    });
+
+    if (!best)
+        return nullptr;
+    return best->entity;
+}
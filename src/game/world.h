@@ -0,0 +1,271 @@
+#ifndef WORLD_H
+#define WORLD_H
+
+#include "game/ecos.h"
+#include "game/quadtree.h"
+#include "game/rvo.h"
+#include "render/opengl.h"
+#include "render/program.h"
+#include "render/material.h"
+#include "render/mesh.h"
+#include "render/renderqueue.h"
+#include "util/threadpool.h"
+#include "util/smallvector.h"
+#include "util/fixedvector.h"
+
+#include <vector>
+
+class World;
+
+
+#pragma pack(push, 1)
+struct LineVertex {
+    vec3 pos;
+    vec4 color;
+    LineVertex() {}
+    LineVertex(vec3 pos, vec4 color) : pos(pos), color(color) {}
+};
+#pragma pack(pop)
+
+
+// dense indexes of the component types we know about statically. these
+// select the direct slot in Entity, so keep them below MAX_INDEXED_COMPONENTS
+enum {
+    BODY_INDEX,
+    SHIP_INDEX,
+    SRND_INDEX
+};
+
+
+// hot fields that are kept in archetype chunks, one contiguous array each
+enum {
+    POS_FIELD,    // vec3, owned by Body
+    VEL_FIELD,    // vec3, owned by Body
+    RADIUS_FIELD, // float, owned by Body
+    DIR_FIELD     // vec3, owned by Ship
+};
+
+
+
+
+struct Body :
+    public PoolComponent<Body, 'BODY', BODY_INDEX, class BodySystem>,
+    public QuadTree::Object
+{
+    enum { MAX_AGENT_NEIGHBORS = 16 };
+    RVO::Agent *rvo_agent;
+    SmallVector<std::pair<float, const RVO::Agent *>, MAX_AGENT_NEIGHBORS> agentNeighbors;
+
+    Body() : rvo_agent(nullptr) {}
+    ~Body() { delete rvo_agent; }
+
+    // keeps the place in the quad tree. spelled out since VS2013 does not
+    // generate move constructors
+    Body(Body &&b) :
+        PoolComponent(b),
+        QuadTree::Object(std::move(b)),
+        rvo_agent(b.rvo_agent),
+        agentNeighbors(std::move(b.agentNeighbors))
+    {
+        b.rvo_agent = nullptr;
+    }
+
+    const vec3 &pos() { return entity->field<vec3>(POS_FIELD); }
+    const vec3 &vel() { return entity->field<vec3>(VEL_FIELD); }
+    float radius() { return entity->field<float>(RADIUS_FIELD); }
+
+    // writes go through these so the body is marked as changed
+    void set_pos(const vec3 &p) { entity->field<vec3>(POS_FIELD) = p; touch(); }
+    void set_vel(const vec3 &v) { entity->field<vec3>(VEL_FIELD) = v; touch(); }
+    void set_radius(float r) { entity->field<float>(RADIUS_FIELD) = r; touch(); }
+
+    void qtree_position(float &x, float &y) override {
+        const vec3 &p = pos();
+        x = p.x;
+        y = p.y;
+    }
+
+    void init(EntityManager *m, Entity *e) override;
+
+    void insertAgentNeighbor(const RVO::Agent *agent, int maxNeighbors, float &rangeSq) {
+        if (this->rvo_agent != agent) {
+            const float distSq = absSq(rvo_agent->position - agent->position);
+
+            if (distSq < rangeSq) {
+                if (agentNeighbors.size() < maxNeighbors) {
+                    agentNeighbors.push_back(std::make_pair(distSq, agent));
+                }
+
+                int i = agentNeighbors.size() - 1;
+
+                while (i != 0 && distSq < agentNeighbors[i - 1].first) {
+                    agentNeighbors[i] = agentNeighbors[i - 1];
+                    --i;
+                }
+
+                agentNeighbors[i] = std::make_pair(distSq, agent);
+
+                if (agentNeighbors.size() == maxNeighbors) {
+                    rangeSq = agentNeighbors.back().first;
+                }
+            }
+        }
+    }
+};
+
+class BodySystem : public PoolSystem<Body, 'BODY'> {
+public:
+    BodySystem() : quad_tree(-1000, -1000, 1000, 1000, 8), last_tick(0) {}
+
+    QuadTree quad_tree;
+
+    // the quad tree counts as part of Body
+    ComponentMask reads() override;
+    ComponentMask writes() override;
+    void update(EntityManager *m, float dt) override;
+    void compact(EntityManager *m) override;
+
+private:
+    unsigned int last_tick; // change tick of the previous update
+};
+
+
+
+
+struct Ship : public PoolComponent<Ship, 'SHIP', SHIP_INDEX, class ShipSystem> {
+    float maxspeed;
+    float maxforce;
+    int team;
+
+    enum { MAX_FRIENDS = 4 };
+    FixedVector<EntityHandle, MAX_FRIENDS> friends;
+    float friend_radius;
+
+    enum { MAX_CLOSEST = 8 };
+    FixedVector<EntityHandle, MAX_CLOSEST> closest;
+    float closest_radius;
+
+    Ship() {
+        friend_radius = 50;
+        closest_radius = 50;
+    }
+
+    void init(EntityManager *m, Entity *e) override;
+
+    // looked up rather than kept, as compaction moves bodies around
+    Body *body() { return entity->get_component<Body>(); }
+
+    const vec3 &dir() { return entity->field<vec3>(DIR_FIELD); }
+    void set_dir(const vec3 &d) { entity->field<vec3>(DIR_FIELD) = d; touch(); }
+
+    void update(EntityManager *m, float dt);
+
+    vec3 planehug();
+    vec3 zseparation(EntityManager *m);
+    vec3 separation(EntityManager *m);
+    vec3 obstacle_avoid(EntityManager *m);
+    vec3 alignment(EntityManager *m);
+    vec3 cohesion(EntityManager *m);
+    vec3 seek(vec3 target);
+    vec3 steer(vec3 dir);
+    vec3 arrive(vec3 target);
+};
+
+class ShipSystem : public PoolSystem<Ship, 'SHIP'> {
+public:
+    ShipSystem(World *world) : world(world), scratch(1024*4, 150, "Ship scratch") {}
+
+    World *world; // for the cursor and debug lines
+    Arena scratch; // temporaries of Ship::update, freed by the end of it
+
+    ComponentMask reads() override { return component_mask<Body, Ship>(); }
+    ComponentMask writes() override { return component_mask<Body, Ship>(); }
+    void update(EntityManager *m, float dt) override;
+};
+
+
+
+
+class SimpleRenderable : public PoolComponent<SimpleRenderable, 'SRND', SRND_INDEX, class SimpleRenderableSystem> {
+public:
+    mat4 model_matrix;
+    Material::Ref material;
+    Mesh::Ref mesh;
+};
+
+class SimpleRenderableSystem : public PoolSystem<SimpleRenderable, 'SRND'> {
+public:
+    // draws those with a body that is in view
+    void render(EntityManager *m, RenderQueue *renderqueue, mat4 view_matrix, mat4 projection_matrix);
+};
+
+
+
+
+// Meshes and materials the worlds refer to. They are shared between worlds,
+// and their refcounts are not atomic, so create worlds and spawn entities
+// from one thread (updating worlds in parallel is fine).
+struct WorldAssets {
+    Mesh::Ref ship_mesh;
+    Mesh::Ref asteroid_mesh;
+    Material::Ref team_materials[2];
+    Material::Ref asteroid_material;
+
+    // create the materials, using program for all of them
+    void create_materials(Program::Ref program);
+};
+
+// One self-contained simulation: entities, systems, spatial index, input
+// and debug output. Worlds share nothing but their assets, so any number
+// of them can live in one process and be updated concurrently.
+class World {
+public:
+    World(const WorldAssets &assets);
+
+    // run the systems for one frame, in parallel on pool if given
+    void update(float dt, ThreadPool *pool = nullptr);
+
+    // update several worlds at once, one pool task per world. the worlds
+    // share the pool for running their systems as well
+    static void update_all(const std::vector<World *> &worlds, float dt, ThreadPool *pool);
+
+    // spawned when the next update finishes, like everything structural
+    void spawn_boid(vec3 pos);
+    void spawn_asteroid(vec3 pos);
+    void spawn_boids(int count, float radius); // scattered around the origin
+    void spawn_asteroids(int count, float radius);
+
+    // the entity with a body closest to p, within 50 units
+    Entity *closest_to(vec3 p);
+
+    WorldAssets assets;
+
+    // systems before the manager, so they outlive the entities
+    BodySystem bodies;
+    ShipSystem ships;
+    SimpleRenderableSystem renderables;
+    EntityManager entities;
+
+    vec3 cursor_pos; // the boids head here
+    EntityHandle selected_entity;
+    std::vector<LineVertex> line_vertexes; // debug lines, drawn and cleared by the renderer
+
+private:
+    // payload of the spawn commands
+    struct SpawnAt {
+        World *world;
+        vec3 pos;
+    };
+    static void init_boid(Entity *e, const SpawnAt &at);
+    static void init_asteroid(Entity *e, const SpawnAt &at);
+
+    // arguments of update_all, kept here so that its tasks capture nothing
+    // but the world and std::function does not allocate
+    float update_dt;
+    ThreadPool *update_pool;
+
+    EntityTemplate boid_template;
+    EntityTemplate asteroid_template;
+};
+
+#endif
@@ -22,6 +22,7 @@
 
 #include "util/list.h"
 #include "util/pool.h"
+#include "util/memstats.h"
 
 #include "render/opengl.h"
 #include "render/program.h"
@@ -34,6 +35,7 @@
 #include "game/fpscamera.h"
 #include "game/quadtree.h"
 #include "game/ecos.h"
+#include "game/world.h"
 #include "game/skybox.h"
 
 #include "btBulletCollisionCommon.h"
@@ -57,697 +59,6 @@
 
 
 
-static RenderQueue renderqueue;
-static Program::Ref ship_program;
-static Mesh::Ref ship_mesh;
-static Mesh::Ref asteroid_mesh;
-
-static vec3 cursor_pos;
-
-
-#pragma pack(push, 1)
-struct LineVertex {
-    vec3 pos;
-    vec4 color;
-    LineVertex() {}
-    LineVertex(vec3 pos, vec4 color) : pos(pos), color(color) {}
-};
-#pragma pack(pop)
-static std::vector<LineVertex> line_vertexes;
-
-static Entity *selected_entity = nullptr;
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-template <class T, SystemType Type>
-class PoolSystem : public System {
-public:
-    enum { TYPE = Type };
-    SystemType type() override { return TYPE; }
-
-    T *create_component() {
-        return pool.create();
-    }
-
-    void destroy_component(T *c) {
-        pool.free(c);
-    }
-
-    typename IterablePool<T>::iterator begin() { return pool.begin(); }
-    typename IterablePool<T>::iterator end() { return pool.end(); }
-
-protected:
-    IterablePool<T> pool;
-};
-
-
-template <class T, ComponentType Type, class SystemT>
-struct PoolComponent : public Component {
-    enum { TYPE = Type };
-    
-    ComponentType type() override { return TYPE; }
-    
-    static T *create(EntityManager *m) {
-        SystemT *sys = m->get_system<SystemT>();
-        return sys->create_component();
-    }
-
-    void destroy(EntityManager *m) override {
-        SystemT *sys = m->get_system<SystemT>();
-        sys->destroy_component(static_cast<T *>(this));
-    }
-};
-
-
-
-
-
-
-
-struct Body :
-    public PoolComponent<Body, 'BODY', class BodySystem>,
-    public QuadTree::Object
-{
-    vec3 pos;
-    vec3 vel;
-    float radius;
-    Entity *entity;
-
-    RVO::Agent *rvo_agent;
-    std::vector<std::pair<float, const RVO::Agent *> > agentNeighbors;
-
-    void qtree_position(float &x, float &y) override {
-        x = pos.x;
-        y = pos.y;
-    }
-
-    void init(EntityManager *m, Entity *e) override;
-
-    void insertAgentNeighbor(const RVO::Agent *agent, size_t maxNeighbors, float &rangeSq) {
-        if (this->rvo_agent != agent) {
-            const float distSq = absSq(rvo_agent->position - agent->position);
-
-            if (distSq < rangeSq) {
-                if (agentNeighbors.size() < maxNeighbors) {
-                    agentNeighbors.push_back(std::make_pair(distSq, agent));
-                }
-
-                size_t i = agentNeighbors.size() - 1;
-
-                while (i != 0 && distSq < agentNeighbors[i - 1].first) {
-                    agentNeighbors[i] = agentNeighbors[i - 1];
-                    --i;
-                }
-
-                agentNeighbors[i] = std::make_pair(distSq, agent);
-
-                if (agentNeighbors.size() == maxNeighbors) {
-                    rangeSq = agentNeighbors.back().first;
-                }
-            }
-        }
-    }
-};
-
-class BodySystem : public PoolSystem<Body, 'BODY'> {
-public:
-    BodySystem() : quad_tree(-1000, -1000, 1000, 1000, 8) {}
-
-    QuadTree quad_tree;
-    std::vector<const RVO::Agent *> agentNeighbors;
-
-    void update(float dt);
-};
-
-
-
-
-
-
-
-
-static bool sweep(Body *b0, Body *b1, float dt, float &t_out) {
-    glm::vec3 v0 = b1->pos - b0->pos;
-    glm::vec3 v1 = v0 + (b1->vel - b0->vel)*dt;
-    float r = (b0->radius + b1->radius);
-
-    float dot00 = glm::dot(v0, v0);
-    float dot01 = glm::dot(v0, v1);
-    float dot11 = glm::dot(v1, v1);
-
-    float a = dot00 - 2.f * dot01 + dot11;
-    float b = 2.f * (dot01 - dot00);
-    float c = dot00 - r*r;
-
-    float det = b*b - 4.f * a*c;
-
-    if (det > 0.f) {
-        float t = -(b + sqrtf(det)) / (2.f * a);
-        if (0.f <= t && t <= 1.f) {
-            t_out = t;
-            return true;
-        }
-    }
-
-    return false;
-}
-
-vec3 limit(vec3 v, float len) {
-    if (glm::length(v) > len)
-        return glm::normalize(v) * len;
-    return v;
-}
-
-
-struct Ship : public PoolComponent<Ship, 'SHIP', class ShipSystem> {
-    vec3 dir;
-    float maxspeed;
-    float maxforce;
-    int team;
-    Body *body;
-
-    enum { MAX_FRIENDS = 4 };
-    Entity *friends[MAX_FRIENDS];
-    float friend_radius;
-
-    enum { MAX_CLOSEST = 8 };
-    Entity *closest[MAX_CLOSEST];
-    float closest_radius;
-
-    Ship() {
-        friend_radius = 50;
-        closest_radius = 50;
-    }
-
-    void init(EntityManager *m, Entity *e) override;
-
-
-
-    void update(EntityManager *m, float dt);
-
-    vec3 planehug() {
-        vec3 target = body->pos;
-        target.z = 0;
-        return arrive(target);
-    }
-
-    vec3 zseparation() {
-        float sep = 20.0f;
-        vec3 sum(0, 0, 0);
-        int count = 0;
-        for (int i = 0; i < MAX_CLOSEST; ++i) {
-            Entity *e = closest[i];
-            if (!e) continue;
-
-            Body *b = e->get_component<Body>();
-            vec3 d = body->pos - b->pos;
-            float len = glm::length(d);
-            if (len > sep || len <= 0.00001f) continue;
-            //d = glm::normalize(d);
-            float dz = d.z;
-            if (dz == 0.0f)
-                dz = glm::dot(glm::normalize(body->vel), glm::normalize(b->vel));
-            dz /= fabsf(dz);
-            dz /= len;
-            sum += vec3(0, 0, dz);
-            ++count;
-        }
-        if (count == 0)
-            return vec3(0, 0, 0);
-        sum /= (float)count;
-        return steer(sum);
-    }
-
-    vec3 separation() {
-        float sep = 20.0f;
-        vec3 sum(0, 0, 0);
-        int count = 0;
-        for (int i = 0; i < MAX_CLOSEST; ++i) {
-            Entity *e = closest[i];
-            if (!e) continue;
-
-            Body *b = e->get_component<Body>();
-            vec3 d = body->pos - b->pos;
-            //d.z = 0;
-            float len = glm::length(d);
-            if (len > sep || len <= 0.00001f) continue;
-            d = glm::normalize(d);
-            d /= len;
-            sum += d;
-            ++count;
-        }
-        if (count == 0)
-            return vec3(0, 0, 0);
-        sum /= (float)count;
-        return steer(sum);
-    }
-
-    vec3 obstacle_avoid() {
-        float t_horizon = 5.0f;
-        float best_t = 10000000.0f;
-        Body *best_b = nullptr;
-
-        vec3 sum(0, 0, 0);
-
-        for (int i = 0; i < MAX_CLOSEST; ++i) {
-            Entity *e = closest[i];
-            if (!e) continue;
-
-            Body *b = e->get_component<Body>();
-
-            float t = 0.0f;
-            if (sweep(body, b, t_horizon, t)) {
-                vec3 p0 = body->pos + body->vel*t*t_horizon;
-                vec3 p1 = b->pos + b->vel*t*t_horizon;
-                sum += glm::normalize(p0 - p1) * (1.0f - t);
-
-                line_vertexes.push_back(LineVertex(body->pos, vec4(0, 1, 0, 0.9f)));
-                line_vertexes.push_back(LineVertex(b->pos, vec4(0, 1, 0, 0.1f)));
-
-                line_vertexes.push_back(LineVertex(body->pos, vec4(0, 0, 1, 1)));
-                line_vertexes.push_back(LineVertex(p0, vec4(0, 0, 1, 1)));
-
-                line_vertexes.push_back(LineVertex(b->pos, vec4(1, 0, 0, 1)));
-                line_vertexes.push_back(LineVertex(p1, vec4(1, 0, 0, 1)));
-
-                if (t < best_t) {
-                    best_t = t;
-                    best_b = b;
-                }
-            }
-        }
-
-        if (!best_b)
-            return vec3(0, 0, 0);
-
-        //vec3 v = steer(glm::cross(body->vel, body->pos - best_b->pos));
-        vec3 v = steer(sum);
-
-        line_vertexes.push_back(LineVertex(body->pos, vec4(1, 1, 1, 0.8f)));
-        line_vertexes.push_back(LineVertex(body->pos + v*3.0f, vec4(1, 1, 1, 0.8f)));
-
-        return v;
-    }
-
-    vec3 alignment() {
-        float neighbordist = 50;
-        vec3 sum(0, 0, 0);
-        int count = 0;
-        for (int i = 0; i < MAX_FRIENDS; ++i) {
-            Entity *e = friends[i];
-            if (!e) continue;
-
-            Body *b = e->get_component<Body>();
-            Ship *s = b->entity->get_component<Ship>();
-            if (s->team != team) continue;
-            
-            vec3 d = body->pos - b->pos;
-            float dist = glm::length(d);
-            if (dist > neighbordist) continue;
-            sum += b->vel;
-            ++count;
-        }
-        if (count == 0)
-            return vec3(0, 0, 0);
-        sum /= (float)count;
-        return steer(sum);
-    }
-
-    vec3 cohesion() {
-        float neighbordist = 50;
-        vec3 sum(0, 0, 0);
-        int count = 0;
-        for (int i = 0; i < MAX_FRIENDS; ++i) {
-            Entity *e = friends[i];
-            if (!e) continue;
-
-            Body *b = e->get_component<Body>();
-            Ship *s = b->entity->get_component<Ship>();
-            if (s->team != team) continue;
-            
-            vec3 d = body->pos - b->pos;
-            float len = glm::length(d);
-            if (len > neighbordist) continue;
-            sum += b->pos;
-            ++count;
-        }
-        if (count == 0)
-            return vec3(0, 0, 0);
-        sum /= (float)count;
-        return seek(sum);
-    }
-
-    vec3 seek(vec3 target) {
-        return steer(target - body->pos);
-    }
-
-    vec3 steer(vec3 dir) {
-        float len = glm::length(dir);
-        if (len < 0.000001f)
-            return vec3(0, 0, 0);
-        dir *= maxspeed / len;
-        return limit(dir - body->vel, maxforce);
-    }
-
-    vec3 arrive(vec3 target) {
-        float brakelimit = 50.0f;
-        vec3 desired = target - body->pos;
-        float len = glm::length(desired);
-        if (len < 0.000001f)
-            return vec3(0, 0, 0);
-        desired /= len;
-        if (len < brakelimit) {
-            desired *= (len / brakelimit) * maxspeed;
-        } else {
-            desired *= maxspeed;
-        }
-        return limit(desired, maxforce);
-    }
-};
-
-class ShipSystem : public PoolSystem<Ship, 'SHIP'> {
-public:
-    void update(EntityManager *m, float dt);
-};
-
-void Ship::init(EntityManager *m, Entity *e) {
-    body = e->get_component<Body>();
-    assert(body);
-}
-
-void ShipSystem::update(EntityManager *m, float dt) {
-    for (Ship *ship : *this) {
-        ship->update(m, dt);
-    }
-}
-
-
-
-
-class SimpleRenderable : public PoolComponent<SimpleRenderable, 'SRND', class SimpleRenderableSystem> {
-public:
-    mat4 model_matrix;
-
-    vec4 ambient_color;
-    vec4 diffuse_color;
-    vec4 specular_color;
-    float shininess;
-
-    Program::Ref program;
-    Mesh::Ref mesh;
-};
-
-class SimpleRenderableSystem : public PoolSystem<SimpleRenderable, 'SRND'> {
-public:
-    void render(RenderQueue *renderqueue, mat4 view_matrix, mat4 projection_matrix) {
-        for (SimpleRenderable *r : *this) {
-            mat4 vm = view_matrix * r->model_matrix;
-            mat4 pvm = projection_matrix * vm;
-            mat3 normal = glm::inverseTranspose(mat3(vm));
-
-            auto cmd = renderqueue->add_command(r->program, r->mesh);
-            cmd->add_uniform("m_pvm", pvm);
-            cmd->add_uniform("m_vm", vm);
-            cmd->add_uniform("m_normal", normal);
-            cmd->add_uniform("mat_ambient", r->ambient_color);
-            cmd->add_uniform("mat_diffuse", r->diffuse_color);
-            cmd->add_uniform("mat_specular", r->specular_color);
-            cmd->add_uniform("mat_shininess", r->shininess);
-        }
-    }
-};
-
-/*
-class Doodad : public PoolComponent<Doodad, 'DOOD', class DoodadSystem> {
-public:
-};
-
-class DoodadSystem : public PoolSystem<Doodad, 'DOOD'> {
-    void update() {
-
-    }
-};
-*/
-
-
-static RVO::Vector3 to_rvo(vec3 v) {
-    return RVO::Vector3(v.x, v.y, v.z);
-}
-
-static vec3 from_rvo(RVO::Vector3 v) {
-    return vec3(v.x, v.y, v.z);
-}
-
-static mat4 calc_rotation_matrix(vec3 dir) {
-    vec3 up(0, 0, 1);
-    vec3 forward(glm::normalize(dir));
-    vec3 right(glm::cross(forward, up));
-    up = glm::cross(right, forward);
-    right = glm::normalize(glm::cross(forward, up));
-    up = glm::normalize(glm::cross(right, forward));
-
-    mat4 m;
-    m[0] = vec4(right, 0);
-    m[1] = vec4(forward, 0);
-    m[2] = vec4(up, 0);
-    return m;
-}
-
-void Body::init(EntityManager *m, Entity *e) {
-    BodySystem *sys = m->get_system<BodySystem>();
-    sys->quad_tree.insert(this);
-    entity = e;
-
-    rvo_agent = new RVO::Agent;
-    rvo_agent->position = to_rvo(pos);
-    rvo_agent->radius = radius;
-    rvo_agent->velocity = RVO::Vector3();
-}
-
-void BodySystem::update(float dt) {
-    for (Body *b : *this) {
-        b->qtree_update();
-        
-        Ship *s = b->entity->get_component<Ship>();
-        SimpleRenderable *r = b->entity->get_component<SimpleRenderable>();
-        if (r && s) {
-            r->model_matrix = glm::translate(b->pos) * calc_rotation_matrix(s->dir);
-        }
-    }
-}
-
-static float adjust_query_radius(float radius, int num_found, int maximum) {
-    if (num_found < maximum) radius += 0.1f;
-    else if (num_found > maximum) radius -= 0.1f;
-    return clamp(radius, 1.0f, 50.0f);
-}
-
-void Ship::update(EntityManager *m, float dt) {
-    BodySystem *sys = m->get_system<BodySystem>();
-    Entity *entity = body->entity;
-
-    int num_friends = 0;
-    int num_closest = 0;
-    memset(friends, 0, sizeof(friends));
-    memset(closest, 0, sizeof(closest));
-
-    float friend_radius_squared = friend_radius*friend_radius;
-    float closest_radius_squared = closest_radius*closest_radius;
-    float query_radius = std::max(friend_radius, closest_radius);
-    
-    vec2 p(body->pos);
-
-    sys->quad_tree.query(p.x - query_radius, p.y - query_radius,
-                         p.x + query_radius, p.y + query_radius,
-                         [&](QuadTree::Object *obj) mutable
-    {
-        Body *b = static_cast<Body *>(obj);
-        if (b == body)
-            return;
-        vec2 d = vec2(b->pos) - p;
-        float dist_squared = d.x*d.x + d.y*d.y;
-
-        if (dist_squared <= friend_radius_squared) {
-            Ship *s = b->entity->get_component<Ship>();
-            if (s && s->team == team) {
-                if (num_friends < MAX_FRIENDS)
-                    friends[num_friends] = b->entity;
-                num_friends++;
-            }
-        }
-
-        if (dist_squared <= closest_radius_squared) {
-            if (num_closest < MAX_CLOSEST)
-                closest[num_closest] = b->entity;
-            num_closest++;
-        }
-    });
-
-    friend_radius = adjust_query_radius(friend_radius, num_friends, MAX_FRIENDS);
-    closest_radius = adjust_query_radius(closest_radius, num_closest, MAX_CLOSEST);
-
-    vec3 acc(0, 0, 0);
-
-    //acc = obstacle_avoid();
-
-    //if (acc == vec3(0, 0, 0)) {
-    acc += separation() * 1.5f;
-    acc += alignment() * 1.0f;
-    acc += cohesion() * 1.0f;
-
-    acc += planehug() * 1.5f;
-    //acc += zseparation() * 1.5f;
-
-    acc += arrive(cursor_pos) * 1.5f;
-    //}
-
-    vec3 desired_vel = limit(body->vel + acc * dt, maxspeed);
-
-
-    body->agentNeighbors.clear();
-    float rvo_radius = 50.0;
-    float rvo_radius_sqr = rvo_radius * rvo_radius;
-    sys->quad_tree.query(p.x - rvo_radius, p.y - rvo_radius,
-                         p.x + rvo_radius, p.y + rvo_radius,
-                         [&](QuadTree::Object *obj) mutable
-    {
-        body->insertAgentNeighbor(static_cast<Body *>(obj)->rvo_agent, 16, rvo_radius_sqr);
-    });
-    sys->agentNeighbors.clear();
-    for (size_t i = 0; i < body->agentNeighbors.size(); ++i) {
-        sys->agentNeighbors.push_back(body->agentNeighbors[i].second);
-    }
-    RVO::Agent *agent = body->rvo_agent;
-    agent->velocity = agent->computeNewVelocity(dt, 10.0, to_rvo(desired_vel), maxspeed, &sys->agentNeighbors[0], sys->agentNeighbors.size());
-    agent->position += agent->velocity * dt;
-    body->pos = from_rvo(agent->position);
-    body->vel = from_rvo(agent->velocity);
-
-
-    float len = glm::length(body->vel);
-    if (len > 0) {
-        vec3 v = body->vel / len;
-        float a = glm::angle(dir, v);
-        if (fabsf(a) > 0.001f) {
-            vec3 axis(glm::cross(dir, v));
-            dir = glm::normalize(dir * glm::angleAxis(glm::min(45.0f * dt, a), axis));
-        }
-    }
-}
-
-
-
-
-
-
-
-static void do_spawn_boid(EntityManager *m, vec3 pos) {
-    pos.z = glm::linearRand(-10.0f, 10.0f);
-    Entity *e = m->create_entity();
-    
-    Body *b = m->add_component<Body>(e);
-    b->pos = pos;
-    b->radius = ship_mesh->radius() * .5f;
-
-    Ship *s = m->add_component<Ship>(e);
-    s->dir = glm::normalize(vec3(glm::diskRand(10.0f), 0.0f));
-    s->maxspeed = glm::linearRand(10.0f, 30.0f);
-    s->maxforce = glm::linearRand(0.5f, 2.0f);
-    s->team = rand() % 2;
-    
-    SimpleRenderable *r = m->add_component<SimpleRenderable>(e);
-    r->mesh = ship_mesh;
-    r->program = ship_program;
-    if (s->team == 0) {
-        r->ambient_color = vec4(0.25f, 0.25f, 0.25f, 1);
-        r->diffuse_color = vec4(0.4f, 0.4f, 0.4f, 1);
-        r->specular_color = vec4(0.774597f, 0.774597f, 0.774597f, 1);
-        r->shininess = 76.8f;
-    } else {
-        r->ambient_color = vec4(0.329412f, 0.223529f, 0.027451f, 1.0f);
-        r->diffuse_color = vec4(0.780392f, 0.568627f, 0.113725f, 1.0f);
-        r->specular_color = vec4(0.992157f, 0.941176f, 0.807843f, 1.0f);
-        r->shininess = 27.89743616f;
-    }
-
-    m->optimize_entity(e);
-    m->init_entity(e);
-}
-
-static void add_asteroid(EntityManager *m, vec3 pos) {
-    pos.z = glm::linearRand(-10.0f, 10.0f);
-    Entity *e = m->create_entity();
-
-    Body *b = m->add_component<Body>(e);
-    b->pos = pos;
-    b->radius = asteroid_mesh->radius() * 10;
-
-    SimpleRenderable *r = m->add_component<SimpleRenderable>(e);
-    r->model_matrix = glm::translate(pos) * glm::scale(vec3(10, 10, 10));
-    r->mesh = asteroid_mesh;
-    r->program = ship_program;
-    r->ambient_color = vec4(0.15f, 0.15f, 0.15f, 1);
-    r->diffuse_color = vec4(0.3f, 0.3f, 0.3f, 1);
-    r->specular_color = vec4(0.4f, 0.4f, 0.4f, 1);
-    r->shininess = 56.8f;
-
-    m->optimize_entity(e);
-    m->init_entity(e);
-}
-
-
-
-
-
-
-static Entity *closest_to_mouse(EntityManager *manager) {
-    BodySystem *sys = manager->get_system<BodySystem>();
-
-    Body *best = nullptr;
-    float best_dist = 100000.0f;
-
-    sys->quad_tree.query(cursor_pos.x - 50, cursor_pos.y - 50,
-                         cursor_pos.x + 50, cursor_pos.y + 50,
-                         [&](QuadTree::Object *obj) mutable
-    {
-        Body *b = static_cast<Body *>(obj);
-        if (!best) {
-            best = b;
-        } else {
-            vec3 d = b->pos - cursor_pos;
-            float dist = glm::length(d);
-            if (dist < best_dist) {
-                best = b;
-                best_dist = dist;
-            }
-        }
-    });
-
-    if (!best)
-        return nullptr;
-    return best->entity;
-}
-
-
-
-
-
-
-
-
-
-
 
 SDL_DisplayMode mode;
 mat4 projection_matrix, view_matrix;
@@ -838,20 +149,22 @@ int main(int argc, char *argv[]) {
     StateContext context; // create a root context
     context.enable(GL_MULTISAMPLE);
 
+    WorldAssets assets;
     try {
-        ship_mesh = Mesh::load("data/meshes/harv.ply");
-        asteroid_mesh = Mesh::load("data/meshes/asteroid.ply");
+        assets.ship_mesh = Mesh::load("data/meshes/harv.ply");
+        assets.asteroid_mesh = Mesh::load("data/meshes/asteroid.ply");
     } catch (const std::exception &e) {
         die("error: %s", e.what());
     }
 
-    ship_program = Program::create();
+    Program::Ref ship_program = Program::create();
     ship_program->attach(Shader::load(GL_VERTEX_SHADER, "data/shaders/simple.vert"));
     ship_program->attach(Shader::load(GL_FRAGMENT_SHADER, "data/shaders/simple.frag"));
     ship_program->attrib("in_pos", 0);
     ship_program->attrib("in_normal", 1);
     ship_program->link();
     ship_program->detach_all();
+    assets.create_materials(ship_program);
 
     Program::Ref line_program = Program::create();
     line_program->attach(Shader::load(GL_VERTEX_SHADER, "data/shaders/color.vert"));
@@ -877,21 +190,14 @@ int main(int argc, char *argv[]) {
 
     //SDL_SetRelativeMouseMode(SDL_TRUE);
 
-    BodySystem body_system;
-    ShipSystem ship_system;
-    SimpleRenderableSystem simple_renderable_system;
-    EntityManager entity_manager;
-    entity_manager.add_system(&body_system);
-    entity_manager.add_system(&ship_system);
-    entity_manager.add_system(&simple_renderable_system);
-    entity_manager.optimize_systems();
-
-    for (int i = 0; i < 40; ++i) {
-        do_spawn_boid(&entity_manager, vec3(glm::diskRand(100.0f), 0.0f));
-    }
-    for (int i = 0; i < 10; ++i) {
-        add_asteroid(&entity_manager, vec3(glm::diskRand(400.0f), 0.0f));
-    }
+    RenderQueue renderqueue;
+    ThreadPool thread_pool;
+
+    World *world = new World(assets);
+    world->line_vertexes.reserve(max_line_vertexes); // so drawing up to the limit never allocates
+    world->spawn_boids(40, 100.0f);
+    world->spawn_asteroids(10, 400.0f);
+    std::vector<World *> worlds(1, world); // all updated at once, see World::update_all
 
     vec3 camera_focus(0, 0, 0);
     float camera_dist = 100;
@@ -960,24 +266,32 @@ int main(int argc, char *argv[]) {
                                   vec3(0, 0, 1));
 
         if (!rotating)
-            cursor_pos = screen_to_world(mx, my);
+            world->cursor_pos = screen_to_world(mx, my);
         
-        if (selected_entity) {
-            if (selected_entity->dying()) {
-                selected_entity = nullptr;
+        if (world->selected_entity) {
+            Entity *e = world->entities.resolve(world->selected_entity);
+            if (!e || e->dying()) {
+                world->selected_entity = EntityHandle();
             }  else {
-                Body *b = selected_entity->get_component<Body>();
-                camera_focus = b->pos;
+                Body *b = e->get_component<Body>();
+                camera_focus = b->pos();
             }
         }
 
-        Entity *hovered_entity = closest_to_mouse(&entity_manager);
+        Entity *hovered_entity = world->closest_to(world->cursor_pos);
 
         //light_dir = glm::normalize(glm::angleAxis(dt*10.0f, vec3(0, 0, 1)) * light_dir);
 
-        ship_system.update(&entity_manager, dt);
-        body_system.update(dt);
-        entity_manager.update();
+        World::update_all(worlds, dt, &thread_pool);
+
+#ifdef COUNT_ALLOCATIONS
+        if (world->entities.frame_allocations()) {
+            printf("frame allocated %u times (ships %u, bodies %u)\n",
+                world->entities.frame_allocations(),
+                world->entities.system_allocations(&world->ships),
+                world->entities.system_allocations(&world->bodies));
+        }
+#endif
 
 
         //////////////////////////////////////////////////////////////////////////////////////////////////
@@ -997,31 +311,35 @@ int main(int argc, char *argv[]) {
 
         skybox.render(view_matrix, perspective_matrix);
 
-        simple_renderable_system.render(&renderqueue, view_matrix, projection_matrix);
+        world->renderables.render(&world->entities, &renderqueue, view_matrix, projection_matrix);
         renderqueue.flush();
 
         {
+            std::vector<LineVertex> &line_vertexes = world->line_vertexes;
+            const int max_debug_vertexes = max_line_vertexes - 8; // leaves room for the hover box
+
             if (orthogonal_projection) {
-                body_system.quad_tree.gather_outlines([&](float x, float y) mutable {
-                    line_vertexes.push_back(LineVertex(vec3(x, y, 0), vec4(1, 1, 1, 0.1f)));
+                world->bodies.quad_tree.gather_outlines([&](float x, float y) mutable {
+                    if (line_vertexes.size() < max_debug_vertexes)
+                        line_vertexes.push_back(LineVertex(vec3(x, y, 0), vec4(1, 1, 1, 0.1f)));
                 });
-                for (auto b : body_system) {
-                    vec3 pos = b->pos;
+                for (auto b : world->bodies) {
+                    if (line_vertexes.size() + 2 > max_debug_vertexes)
+                        break;
+                    vec3 pos = b->pos();
                     pos.z = 0;
                     line_vertexes.push_back(LineVertex(pos, vec4(1, 1, 1, 0.2f)));
-                    line_vertexes.push_back(LineVertex(b->pos, vec4(1, 1, 1, 0.2f)));
+                    line_vertexes.push_back(LineVertex(b->pos(), vec4(1, 1, 1, 0.2f)));
                 }
-                if (line_vertexes.size() > max_line_vertexes)
-                    line_vertexes.resize(max_line_vertexes);
             }
 
             if (hovered_entity) {
                 Body *b = hovered_entity->get_component<Body>();
 
-                vec3 p0 = b->pos - camera_right*b->radius;
-                vec3 p1 = b->pos - camera_up*b->radius;
-                vec3 p2 = b->pos + camera_right*b->radius;
-                vec3 p3 = b->pos + camera_up*b->radius;
+                vec3 p0 = b->pos() - camera_right*b->radius();
+                vec3 p1 = b->pos() - camera_up*b->radius();
+                vec3 p2 = b->pos() + camera_right*b->radius();
+                vec3 p3 = b->pos() + camera_up*b->radius();
 
                 vec4 c(1, 1, 1, 0.5f);
 
@@ -1038,6 +356,9 @@ int main(int argc, char *argv[]) {
                 line_vertexes.push_back(LineVertex(p0, c));
             }
 
+            if (line_vertexes.size() > max_line_vertexes)
+                line_vertexes.resize(max_line_vertexes);
+
             line_buf->bind();
             line_buf->write(0, sizeof(line_vertexes[0])*line_vertexes.size(), &line_vertexes[0]);
             line_buf->unbind();
@@ -1073,7 +394,7 @@ int main(int argc, char *argv[]) {
             motion += camera_forward;
         if (keys[SDL_SCANCODE_DOWN] || keys[SDL_SCANCODE_S] || (my == mode.h - 1 && !rotating))
             motion -= camera_forward;
-        if (glm::length(motion) > 0 && !selected_entity) {
+        if (glm::length(motion) > 0 && !world->selected_entity) {
             motion = glm::normalize(motion);
             camera_focus += motion * sqrtf(camera_dist) * 0.2f;
         }
@@ -1083,7 +404,14 @@ int main(int argc, char *argv[]) {
             switch (event.type) {
             case SDL_KEYDOWN:
                 if (event.key.keysym.sym == SDLK_f)
-                    add_asteroid(&entity_manager, cursor_pos);
+                    world->spawn_asteroid(world->cursor_pos);
+                if (event.key.keysym.sym == SDLK_m)
+                    dump_memory_stats();
+                if (event.key.keysym.sym == SDLK_c) {
+                    // moves entities around, so look the hovered one up again
+                    world->entities.compact();
+                    hovered_entity = world->closest_to(world->cursor_pos);
+                }
                 break;
             case SDL_KEYUP:
                 if (event.key.keysym.sym == SDLK_ESCAPE)
@@ -1120,9 +448,9 @@ int main(int argc, char *argv[]) {
                 break;
             case SDL_MOUSEBUTTONDOWN:
                 if (event.button.button == SDL_BUTTON_LEFT) {
-                    do_spawn_boid(&entity_manager, cursor_pos);
+                    world->spawn_boid(world->cursor_pos);
                 } else if (event.button.button == SDL_BUTTON_MIDDLE) {
-                    selected_entity = hovered_entity;
+                    world->selected_entity = hovered_entity ? hovered_entity->handle() : EntityHandle();
                 } else if (event.button.button == SDL_BUTTON_RIGHT) {
                     if (!rotating) {
                         rotating = true;
@@ -1145,9 +473,9 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    delete world;
+    assets = WorldAssets();
     ship_program = 0;
-    ship_mesh = 0;
-    asteroid_mesh = 0;
 
     if (music) {
         printf("Freeing music...\n");
@@ -1,5 +1,9 @@
 #include "opengl.h"
 #include "bufferobject.h"
+#include "util/memstats.h"
+
+// live is the number of buffer objects, bytes their total size
+static MemoryStatsEntry buffer_stats("BufferObject");
 
 BufferObject::Ref BufferObject::create() {
 	return new BufferObject();
@@ -9,10 +13,15 @@ BufferObject::BufferObject() {
 	_target = 0;
 	_size = 0;
 	glGenBuffers(1, &_handle);
+	buffer_stats.add_live(1);
+	buffer_stats.capacity = buffer_stats.live;
 }
 
 BufferObject::~BufferObject() {
 	glDeleteBuffers(1, &_handle);
+	buffer_stats.add_live(-1);
+	buffer_stats.capacity = buffer_stats.live;
+	buffer_stats.bytes -= _size;
 }
 
 void BufferObject::bind(GLenum target) {
@@ -28,6 +37,7 @@ void BufferObject::unbind() {
 
 void BufferObject::data(GLsizeiptr size, const GLvoid *data, GLenum usage) {
 	assert(_target);
+	buffer_stats.bytes += size - _size;
 	_size = size;
 	glBufferData(_target, size, data, usage);
 }
@@ -0,0 +1,37 @@
+#include "opengl.h"
+#include "material.h"
+
+#include <cassert>
+
+Material::Ref Material::create(Program::Ref program) {
+    return new Material(program);
+}
+
+Material::Material(Program::Ref program) : _program(program) {
+    assert(program);
+}
+
+Material::~Material() {
+    for (auto b : _uniforms)
+        delete b;
+}
+
+Program::Ref Material::program() {
+    return _program;
+}
+
+void Material::apply() {
+    for (auto b : _uniforms)
+        b->set_uniform(_program);
+}
+
+void Material::set_binding(UniformBinding *binding) {
+    for (auto &b : _uniforms) {
+        if (b->location == binding->location) {
+            delete b;
+            b = binding;
+            return;
+        }
+    }
+    _uniforms.push_back(binding);
+}
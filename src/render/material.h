@@ -0,0 +1,73 @@
+#ifndef MATERIAL_H
+#define MATERIAL_H
+
+// requires: opengl.h
+#include "util/refcounted.h"
+#include "render/program.h"
+#include <vector>
+
+
+struct UniformBinding {
+    GLint location;
+    UniformBinding *next;
+
+    UniformBinding(GLint location) : location(location), next(nullptr) {}
+    virtual ~UniformBinding() {}
+
+    virtual void set_uniform(Program::Ref program) = 0;
+};
+
+
+template <typename T>
+struct UniformBindingImpl : public UniformBinding {
+    T value;
+
+    UniformBindingImpl(GLint location, const T &value)
+        : UniformBinding(location), value(value) {}
+
+    virtual void set_uniform(Program::Ref program) {
+        program->uniform(location, value);
+    }
+};
+
+
+// Uniform values shared by everything drawn with it (surface colors and
+// such). Render commands using the same material are batched, and its
+// uniforms are set once per batch instead of once per command.
+class Material : public RefCounted {
+public:
+    typedef boost::intrusive_ptr<Material> Ref;
+
+    static Ref create(Program::Ref program);
+
+    Program::Ref program();
+
+    // the program must be linked. setting a uniform again replaces it
+    template <typename T>
+    void set(const char *name, const T &value) {
+        set(_program->uniform_location(name), value);
+    }
+
+    template <typename T>
+    void set(GLint location, const T &value) {
+        set_binding(new UniformBindingImpl<T>(location, value));
+    }
+
+    // set the uniforms on the program, which must be bound
+    void apply();
+
+protected:
+    Material(Program::Ref program);
+    ~Material();
+
+private:
+    Material(const Material &);
+    Material &operator=(const Material &);
+
+    void set_binding(UniformBinding *binding);
+
+    Program::Ref _program;
+    std::vector<UniformBinding *> _uniforms;
+};
+
+#endif
@@ -6,6 +6,8 @@ struct CommandCompare {
     bool operator()(RenderCommand *a, RenderCommand *b) const {
         if (a->program.get() < b->program.get()) return true;
         if (a->program.get() > b->program.get()) return false;
+        if (a->material.get() < b->material.get()) return true;
+        if (a->material.get() > b->material.get()) return false;
         if (a->mesh.get() < b->mesh.get()) return true;
         return false;
     }
@@ -20,12 +22,19 @@ RenderCommand *RenderQueue::add_command(Program::Ref program, Mesh::Ref mesh) {
     return cmd;
 }
 
+RenderCommand *RenderQueue::add_command(Material::Ref material, Mesh::Ref mesh) {
+    RenderCommand *cmd = add_command(material->program(), mesh);
+    cmd->material = material;
+    return cmd;
+}
+
 void RenderQueue::sort() {
     std::sort(commands.begin(), commands.end(), CommandCompare());
 }
 
 void RenderQueue::perform() {
     Program *program = nullptr;
+    Material *material = nullptr;
     Mesh *mesh = nullptr;
 
     for (auto cmd : commands) {
@@ -33,6 +42,13 @@ void RenderQueue::perform() {
             if (program) program->unbind();
             program = cmd->program.get();
             program->bind();
+            material = nullptr;
+        }
+
+        // commands are sorted by material, so this happens once per batch
+        if (cmd->material.get() != material) {
+            material = cmd->material.get();
+            if (material) material->apply();
         }
 
         for (auto b = cmd->uniforms; b; b = b->next) {
@@ -59,6 +75,6 @@ void RenderQueue::clear() {
     for (auto cmd : commands)
         cmd->~RenderCommand();
     commands.clear();
-    arena.clear();
+    arena.rewind(); // keep the buffers for the next frame
 }
 
@@ -3,38 +3,18 @@
 
 // requires: opengl.h
 #include "render/program.h"
+#include "render/material.h"
 #include "render/mesh.h"
 #include "util/arena.h"
 #include <vector>
 
 
-struct UniformBinding {
-    GLint location;
-    UniformBinding *next;
-
-    UniformBinding(GLint location) : location(location), next(nullptr) {}
-    
-    virtual void set_uniform(Program::Ref program) = 0;
-};
-
-
-template <typename T>
-struct UniformBindingImpl : public UniformBinding {
-    T value;
-
-    UniformBindingImpl(GLint location, const T &value)
-        : UniformBinding(location), value(value) {}
-    
-    virtual void set_uniform(Program::Ref program) {
-        program->uniform(location, value);
-    }
-};
-
 class RenderQueue;
 
 class RenderCommand {
 public:
     Program::Ref program;
+    Material::Ref material; // optional, applied before the command's own uniforms
     Mesh::Ref mesh;
 
     bool indexed;
@@ -71,11 +51,14 @@ private:
 
 class RenderQueue {
 public:
+    RenderQueue() : arena(1024*64, 150, "RenderQueue") {}
+
     ~RenderQueue() {
         clear();
     }
 
     RenderCommand *add_command(Program::Ref program, Mesh::Ref mesh);
+    RenderCommand *add_command(Material::Ref material, Mesh::Ref mesh);
 
     void sort();
     void perform();
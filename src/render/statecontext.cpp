@@ -1,7 +1,6 @@
 #include "render/opengl.h"
 #include "render/statecontext.h"
 #include "util/fixedhashtable.h"
-#include "deps/mtrand.h"
 #include <cstring>
 
 #define Foreach_Enabled(X) \
@@ -71,8 +70,7 @@ GLenum enabled_values[Enabled_Max] = {
 #define InsertEnum(Enum) enabled_indexes.insert(EnumIndex(Enum, _enum_##Enum));
 static void init_enabled_indexes() {
     Foreach_Enabled(InsertEnum);
-    MTRand_int32 rnd;
-    enabled_indexes.optimize(rnd);
+    enabled_indexes.optimize();
 }
 
 static unsigned int enabled_index(GLenum x) {
@@ -0,0 +1,78 @@
+#include "allocstats.h"
+#include <atomic>
+#include <new>
+#include <cstdlib>
+
+#ifdef COUNT_ALLOCATIONS
+
+// plain data, so that they are zeroed before any constructor runs
+static std::atomic<unsigned int> total_count;
+#ifdef _MSC_VER
+static __declspec(thread) unsigned int thread_count;
+#else
+static __thread unsigned int thread_count;
+#endif
+
+static void *counted_malloc(size_t size) {
+    total_count.fetch_add(1, std::memory_order_relaxed);
+    ++thread_count;
+    return malloc(size ? size : 1);
+}
+
+void *operator new(size_t size) {
+    void *p = counted_malloc(size);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size) {
+    void *p = counted_malloc(size);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new(size_t size, const std::nothrow_t &) throw() {
+    return counted_malloc(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) throw() {
+    return counted_malloc(size);
+}
+
+void operator delete(void *p) throw() {
+    free(p);
+}
+
+void operator delete[](void *p) throw() {
+    free(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) throw() {
+    free(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) throw() {
+    free(p);
+}
+
+unsigned int allocation_count() {
+    return total_count.load(std::memory_order_relaxed);
+}
+
+unsigned int thread_allocation_count() {
+    return thread_count;
+}
+
+#else
+
+unsigned int allocation_count() {
+    return 0;
+}
+
+unsigned int thread_allocation_count() {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef ALLOCSTATS_H
+#define ALLOCSTATS_H
+
+// Counts the heap allocations made through operator new, to find them in
+// (and keep them out of) code that runs every frame. Counting is compiled
+// in for debug builds, or when COUNT_ALLOCATIONS is defined, e.g. by
+// "make COUNT_ALLOCATIONS=1" to profile a release build. Otherwise the
+// counts stay 0 and operator new is left alone.
+#if defined(_DEBUG) && !defined(COUNT_ALLOCATIONS)
+#define COUNT_ALLOCATIONS
+#endif
+
+// allocations so far, by all threads
+unsigned int allocation_count();
+
+// allocations so far, by the calling thread
+unsigned int thread_allocation_count();
+
+#endif
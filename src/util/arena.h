@@ -4,14 +4,19 @@
 #include <cstring>
 #include <cstdlib>
 #include <cassert>
+#include <cstdint>
 #include <vector>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include "util/memstats.h"
 
 class Arena {
     enum { MAX_BUFFER_SIZE = 1024*1024*2 };
 public:
-    Arena(int initial_size = 1024*64, int growth_factor = 150)
-        : initial_size(initial_size), curr_buffer(nullptr),
-          curr_used(0), curr_size(0), growth_factor(growth_factor)
+    Arena(int initial_size = 1024*64, int growth_factor = 150, const char *name = "Arena")
+        : stats(name), initial_size(initial_size), curr(-1), curr_buffer(nullptr),
+          curr_used(0), curr_size(0), prev_used(0), growth_factor(growth_factor)
     {
         assert(initial_size <= MAX_BUFFER_SIZE);
         assert(growth_factor <= 500);
@@ -22,50 +27,97 @@ public:
         clear();
     }
 
+    // free everything, including the buffers
     void clear() {
-        if (curr_buffer) {
-            delete[] curr_buffer;
-            curr_buffer = nullptr;
-            curr_used = 0;
-            curr_size = 0;
-            for (size_t i = 0; i < buffers.size(); ++i)
-                delete[] buffers[i];
-            buffers.clear();
+        for (size_t i = 0; i < buffers.size(); ++i)
+            delete[] buffers[i].data;
+        buffers.clear();
+        curr = -1;
+        curr_buffer = nullptr;
+        curr_used = 0;
+        curr_size = 0;
+        prev_used = 0;
+        stats.live = 0;
+        stats.capacity = 0;
+        stats.bytes = 0;
+    }
+
+    // Free everything but keep the buffers, to be filled again in the same
+    // order. For memory that is rebuilt every frame, so that after the first
+    // few frames no more buffers are allocated.
+    void rewind() {
+        if (buffers.empty())
+            return;
+        set_current(0);
+    }
+
+    // Free everything and keep only the largest buffer. Since buffers grow,
+    // repeated use settles on one buffer big enough for all of it, unless
+    // that would exceed the maximum buffer size.
+    void reset() {
+        if (buffers.empty())
+            return;
+        size_t largest = 0;
+        for (size_t i = 1; i < buffers.size(); ++i)
+        if (buffers[i].size > buffers[largest].size)
+            largest = i;
+        for (size_t i = 0; i < buffers.size(); ++i)
+        if (i != largest) {
+            delete[] buffers[i].data;
+            stats.capacity -= buffers[i].size;
         }
+        stats.bytes = stats.capacity;
+        buffers[0] = buffers[largest];
+        buffers.resize(1);
+        set_current(0);
     }
 
     template <class T>
     T *alloc() {
-        void *buf = alloc(sizeof(T));
+        void *buf = alloc_aligned(sizeof(T), std::alignment_of<T>::value);
         return new (buf) T();
     }
 
     template<class T, typename ...Args>
     T *alloc(Args&&... params) {
-        void *buf = alloc(sizeof(T));
+        void *buf = alloc_aligned(sizeof(T), std::alignment_of<T>::value);
         return new (buf) T(std::forward<Args>(params)...);
     }
 
+    // n default constructed Ts. like everything in the arena, they are
+    // never destroyed
+    template <class T>
+    T *alloc_array(int n) {
+        T *array = (T *)alloc_aligned(sizeof(T) * n, std::alignment_of<T>::value);
+        for (int i = 0; i < n; ++i)
+            new (array + i) T();
+        return array;
+    }
+
+    // align must be a power of two
+    void *alloc_aligned(int size, int align) {
+        assert(align > 0 && !(align & (align - 1)));
+        int pad = padding(align);
+        if (curr_used + pad + size >= curr_size) {
+            next_buffer(size + align - 1);
+            pad = padding(align);
+        }
+        char *result = curr_buffer + curr_used + pad;
+        curr_used += pad + size;
+        update_live();
+        return result;
+    }
+
+    // not aligned in any way
     void *alloc(int size) {
         if (curr_used + size < curr_size) {
             // maybe help simple branch predictors...
         } else {
-            assert(size <= MAX_BUFFER_SIZE);
-            if (curr_size == 0)
-                curr_size = initial_size;
-            else
-                curr_size = (curr_size * growth_factor) / 100;
-            if (curr_size > MAX_BUFFER_SIZE)
-                curr_size = MAX_BUFFER_SIZE;
-            if (size > curr_size)
-                curr_size = size;
-            if (curr_buffer)
-                buffers.push_back(curr_buffer);
-            curr_used = 0;
-            curr_buffer = new char[curr_size];
+            next_buffer(size);
         }
         char *result = curr_buffer + curr_used;
         curr_used += size;
+        update_live();
         return result;
     }
 
@@ -82,13 +134,159 @@ public:
         return buf;
     }
 
+    // live and peak are bytes handed out since the last rewind (including
+    // what was skipped at the ends of buffers), capacity is the bytes in
+    // the buffers
+    const MemoryStats &memory_stats() { return stats; }
+    void set_name(const char *name) { stats.set_name(name); }
+
 private:
+    friend class ArenaMarker;
+
+    struct Buffer {
+        char *data;
+        int size;
+    };
+
+    // bytes to skip for the next allocation to be aligned
+    int padding(int align) {
+        return (int)(-(intptr_t)(curr_buffer + curr_used) & (align - 1));
+    }
+
+    // go back to where the arena was at when buffer was current and had
+    // used bytes in use. later buffers are kept for reuse
+    void roll_back(int buffer, int used) {
+        if (buffer < 0) {
+            if (!buffers.empty())
+                set_current(0);
+            return;
+        }
+        set_current(buffer);
+        curr_used = used;
+        update_live();
+    }
+
+    void set_current(int i) {
+        prev_used = 0;
+        for (int j = 0; j < i; ++j)
+            prev_used += buffers[j].size;
+        curr = i;
+        curr_buffer = buffers[i].data;
+        curr_size = buffers[i].size;
+        curr_used = 0;
+        update_live();
+    }
+
+    void update_live() {
+        stats.set_live(prev_used + curr_used);
+    }
+
+    // move on to the next kept buffer if size fits in it, or else put a
+    // new one in front of it
+    void next_buffer(int size) {
+        assert(size <= MAX_BUFFER_SIZE);
+        int next = curr + 1;
+        if (next < (int)buffers.size() && size < buffers[next].size) {
+            set_current(next);
+            return;
+        }
+
+        int new_size;
+        if (curr_size == 0)
+            new_size = initial_size;
+        else
+            new_size = (curr_size * growth_factor) / 100;
+        if (new_size > MAX_BUFFER_SIZE)
+            new_size = MAX_BUFFER_SIZE;
+        if (size >= new_size)
+            new_size = size + 1;
+        Buffer b = { new char[new_size], new_size };
+        buffers.insert(buffers.begin() + next, b);
+        stats.capacity += new_size;
+        stats.bytes += new_size;
+        set_current(next);
+    }
+
+    // non-copyable
+    Arena(const Arena &);
+    Arena &operator=(const Arena &);
+
+    MemoryStatsEntry stats;
     int initial_size;
+    std::vector<Buffer> buffers; // in the order they are filled
+    int curr; // index of the buffer being filled, -1 if there are none
     char *curr_buffer;
     int curr_used;
     int curr_size;
+    int prev_used; // sizes of the buffers before the current one
     int growth_factor;
-    std::vector<char *> buffers;
+};
+
+
+// Frees everything allocated from the arena during its lifetime when it
+// goes out of scope, for temporaries used in LIFO order. Must not outlive
+// a clear(), rewind() or reset() of the arena.
+class ArenaMarker {
+public:
+    explicit ArenaMarker(Arena &arena) : arena(arena), buffer(arena.curr), used(arena.curr_used) {}
+    ~ArenaMarker() { arena.roll_back(buffer, used); }
+
+private:
+    // non-copyable
+    ArenaMarker(const ArenaMarker &);
+    ArenaMarker &operator=(const ArenaMarker &);
+
+    Arena &arena;
+    int buffer;
+    int used;
+};
+
+
+// A pair of arenas used on alternate frames, so that whatever is allocated
+// during frame N stays valid through frame N+1. This lets another thread
+// (e.g. one that renders) read the data of one frame while the next one
+// is being built.
+class FrameArena {
+public:
+    FrameArena(int initial_size = 1024*64, int growth_factor = 150, const char *name = "FrameArena")
+        : frame(0)
+    {
+        for (int i = 0; i < 2; ++i)
+            arenas[i] = new Arena(initial_size, growth_factor, name);
+    }
+
+    ~FrameArena() {
+        for (int i = 0; i < 2; ++i)
+            delete arenas[i];
+    }
+
+    // the arena of the frame being built, and of the one before it
+    Arena &current() { return *arenas[frame & 1]; }
+    Arena &previous() { return *arenas[(frame & 1) ^ 1]; }
+
+    // start the next frame, reusing the memory of the one before the
+    // previous one. the reader must be done with that by now
+    void next_frame() {
+        ++frame;
+        current().rewind();
+    }
+
+    template <class T, typename ...Args>
+    T *alloc(Args&&... params) {
+        return current().alloc<T>(std::forward<Args>(params)...);
+    }
+
+    void *alloc(int size) {
+        return current().alloc(size);
+    }
+
+private:
+    // non-copyable
+    FrameArena(const FrameArena &);
+    FrameArena &operator=(const FrameArena &);
+
+    Arena *arenas[2];
+    unsigned int frame;
 };
 
 #endif
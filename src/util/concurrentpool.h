@@ -0,0 +1,440 @@
+#ifndef CONCURRENTPOOL_H
+#define CONCURRENTPOOL_H
+
+#include "util/pool.h"
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <cassert>
+
+// VS2013 has no thread_local, but its __declspec(thread) does fine for
+// plain data
+#ifdef _MSC_VER
+#define POOL_THREAD_LOCAL __declspec(thread)
+#else
+#define POOL_THREAD_LOCAL __thread
+#endif
+
+// Small numbers for threads, handed out in the order they first ask and
+// never reused. Meant for long lived threads, such as those of a ThreadPool.
+template <class Dummy = void>
+struct ThreadIndex {
+    static int get() {
+        static POOL_THREAD_LOCAL int index; // plus one, 0 until assigned
+        if (!index)
+            index = next.fetch_add(1) + 1;
+        return index - 1;
+    }
+
+private:
+    static std::atomic<int> next;
+};
+
+template <class Dummy>
+std::atomic<int> ThreadIndex<Dummy>::next(0);
+
+
+// An IterablePool that can be used from several threads at once. Free
+// objects are cached per thread in magazines (fixed size stacks), so create
+// and free normally touch nothing shared but the object's bitmap word. A
+// thread whose magazines run empty or full swaps one, whole, with a shared
+// depot under a lock. Objects may be freed by a different thread than the
+// one which created them; they just go to the freeing thread's cache.
+//
+// Iteration, compact() and stats() must not overlap with create or free.
+// The live count in memory_stats() is only brought up to date when the
+// depot is used, so it lags behind by up to a few magazines per thread.
+// Only the first MAX_THREADS threads get a cache; any others share one
+// behind a lock.
+template <class T>
+class ConcurrentPool {
+    struct Block {
+        Block *next;
+        int index; // objects below this have been handed out to magazines
+        int num_objects;
+        std::atomic<uint64_t> *live; // one bit per object
+        T *objects;
+
+        int num_words() { return (index + 63) >> 6; }
+
+        bool is_live(int i) {
+            return (live[i >> 6].load(std::memory_order_relaxed) >> (i & 63)) & 1;
+        }
+    };
+
+    enum {
+        MAGAZINE_SIZE = 32,
+        MAX_THREADS = 64,
+        CACHE_LINE = 64,
+        MIN_BLOCK_BYTES = 16*1024,
+        MIN_BLOCK_OBJECTS = MAGAZINE_SIZE,
+        HEADER_BYTES = (sizeof(Block) + 15) & ~15
+    };
+
+    struct Magazine {
+        int count;
+        T *objects[MAGAZINE_SIZE];
+    };
+
+    // written only by the owning thread. the counters are atomic just so
+    // stats() may read them
+    struct CacheFields {
+        Magazine *loaded; // objects are taken from and returned to this
+        Magazine *previous; // full or empty, swapped in before the depot is asked
+        std::atomic<unsigned int> num_creates;
+        std::atomic<unsigned int> num_frees;
+    };
+
+    // padded so that no two threads write the same cache line
+    struct ThreadCache : CacheFields {
+        char pad[CACHE_LINE - sizeof(CacheFields) % CACHE_LINE];
+    };
+
+public:
+    typedef T *value_type;
+    typedef BlockIterator<T, Block> iterator;
+
+    struct Stats {
+        int live; // objects created and not freed
+        int blocks;
+        int capacity; // objects the blocks can hold
+        int cached; // free objects in magazines, per thread or in the depot
+        unsigned int creates;
+        unsigned int frees;
+        unsigned int exchanges; // magazines swapped with the depot
+    };
+
+    iterator begin() { return iterator(first); }
+    iterator end() { return iterator(nullptr); }
+
+    ConcurrentPool(int initial_size = 16, const char *name = "ConcurrentPool") :
+        memstats(name),
+        block_bytes(MIN_BLOCK_BYTES),
+        first(nullptr),
+        last(nullptr),
+        fresh(nullptr),
+        fresh_available(0),
+        num_blocks(0),
+        num_exchanges(0),
+        count(0)
+    {
+        while (objects_in(block_bytes) < MIN_BLOCK_OBJECTS)
+            block_bytes *= 2;
+        objects_per_block = objects_in(block_bytes);
+
+        caches = (ThreadCache *)aligned_malloc(sizeof(ThreadCache) * (MAX_THREADS + 1), CACHE_LINE);
+        assert(caches);
+        for (int i = 0; i <= MAX_THREADS; ++i) {
+            ThreadCache *c = new (caches + i) ThreadCache;
+            c->loaded = new_magazine();
+            c->previous = new_magazine();
+            c->num_creates = 0;
+            c->num_frees = 0;
+        }
+        reserve(initial_size);
+    }
+
+    ~ConcurrentPool() {
+        if (count) {
+            for (T *obj : *this)
+                obj->~T();
+        }
+        for (int i = 0; i <= MAX_THREADS; ++i) {
+            delete caches[i].loaded;
+            delete caches[i].previous;
+            caches[i].~ThreadCache();
+        }
+        aligned_free(caches);
+        for (Magazine *m : full)
+            delete m;
+        for (Magazine *m : empty)
+            delete m;
+        while (first) {
+            Block *next = first->next;
+            aligned_free(first);
+            first = next;
+        }
+    }
+
+    template<typename ...Args>
+    T *create(Args&&... params) {
+        T *obj;
+        int i = ThreadIndex<>::get();
+        if (i < MAX_THREADS) {
+            obj = alloc(caches + i);
+        } else {
+            std::lock_guard<std::mutex> lock(overflow_mutex);
+            obj = alloc(caches + MAX_THREADS);
+        }
+        count.fetch_add(1, std::memory_order_relaxed);
+        set_live(obj, true);
+        return new (obj)T(std::forward<Args>(params)...);
+    }
+
+    void free(T *obj) {
+        obj->~T();
+        set_live(obj, false);
+        count.fetch_sub(1, std::memory_order_relaxed);
+        int i = ThreadIndex<>::get();
+        if (i < MAX_THREADS) {
+            release(caches + i, obj);
+        } else {
+            std::lock_guard<std::mutex> lock(overflow_mutex);
+            release(caches + MAX_THREADS, obj);
+        }
+    }
+
+    int size() {
+        return count.load(std::memory_order_relaxed);
+    }
+
+    int block_objects() {
+        return objects_per_block;
+    }
+
+    template <class Func>
+    void for_each_span(Func func) {
+        for_each_block_span(first, func);
+    }
+
+    // make sure that at least n more objects can be handed out without
+    // allocating blocks
+    void reserve(int n) {
+        std::lock_guard<std::mutex> lock(depot_mutex);
+        while (fresh_available < n)
+            append_block();
+        note_live();
+    }
+
+    // Like IterablePool::compact. The caches are emptied, so every free
+    // slot is a fresh one afterwards.
+    template <class Func>
+    void compact(Func relocate) {
+        std::lock_guard<std::mutex> lock(depot_mutex);
+        for (int i = 0; i <= MAX_THREADS; ++i) {
+            caches[i].loaded->count = 0;
+            caches[i].previous->count = 0;
+        }
+        for (Magazine *m : full) {
+            m->count = 0;
+            empty.push_back(m);
+        }
+        full.clear();
+
+        std::vector<Block *> blocks;
+        for (Block *b = first; b; b = b->next)
+            blocks.push_back(b);
+        int n = objects_per_block;
+        pack_blocks<T>(blocks, n, relocate);
+
+        int live_count = size();
+        first = last = fresh = nullptr;
+        fresh_available = 0;
+        num_blocks = 0;
+        for (size_t k = 0; k < blocks.size(); ++k) {
+            Block *b = blocks[k];
+            int live = live_count - (int)k * n;
+            if (live <= 0) {
+                memstats.capacity -= objects_per_block;
+                memstats.bytes -= block_bytes;
+                aligned_free(b);
+                continue;
+            }
+            if (live > n)
+                live = n;
+            b->next = nullptr;
+            b->index = live;
+            link_block(b);
+            if (live < n) {
+                fresh = b;
+                fresh_available = n - live;
+            }
+        }
+    }
+
+    Stats stats() {
+        std::lock_guard<std::mutex> lock(depot_mutex);
+        Stats s;
+        s.live = size();
+        s.blocks = num_blocks;
+        s.capacity = num_blocks * objects_per_block;
+        s.cached = 0;
+        s.creates = 0;
+        s.frees = 0;
+        s.exchanges = num_exchanges;
+        for (int i = 0; i <= MAX_THREADS; ++i) {
+            ThreadCache &c = caches[i];
+            s.cached += c.loaded->count + c.previous->count;
+            s.creates += c.num_creates.load(std::memory_order_relaxed);
+            s.frees += c.num_frees.load(std::memory_order_relaxed);
+        }
+        s.cached += (int)full.size() * MAGAZINE_SIZE;
+        note_live();
+        return s;
+    }
+
+    const MemoryStats &memory_stats() {
+        std::lock_guard<std::mutex> lock(depot_mutex);
+        note_live();
+        return memstats;
+    }
+
+    void set_name(const char *name) { memstats.set_name(name); }
+
+private:
+    // non-copyable
+    ConcurrentPool(const ConcurrentPool &);
+    ConcurrentPool &operator=(const ConcurrentPool &);
+
+    T *alloc(ThreadCache *c) {
+        c->num_creates.store(c->num_creates.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        if (!c->loaded->count) {
+            if (c->previous->count) {
+                std::swap(c->loaded, c->previous);
+            } else {
+                std::lock_guard<std::mutex> lock(depot_mutex);
+                if (full.size()) {
+                    // both ours are empty. give one back for a full one
+                    empty.push_back(c->loaded);
+                    c->loaded = full.back();
+                    full.pop_back();
+                    ++num_exchanges;
+                } else {
+                    refill(c->loaded);
+                }
+                note_live();
+            }
+        }
+        Magazine *m = c->loaded;
+        assert(m->count > 0);
+        return m->objects[--m->count];
+    }
+
+    void release(ThreadCache *c, T *obj) {
+        c->num_frees.store(c->num_frees.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        if (c->loaded->count == MAGAZINE_SIZE) {
+            if (c->previous->count == 0) {
+                std::swap(c->loaded, c->previous);
+            } else {
+                // both ours are full. hand one to the depot for an empty one
+                std::lock_guard<std::mutex> lock(depot_mutex);
+                full.push_back(c->loaded);
+                if (empty.size()) {
+                    c->loaded = empty.back();
+                    empty.pop_back();
+                } else {
+                    c->loaded = new_magazine();
+                }
+                ++num_exchanges;
+                note_live();
+            }
+        }
+        Magazine *m = c->loaded;
+        m->objects[m->count++] = obj;
+    }
+
+    // fill m with fresh objects. called with the depot lock held
+    void refill(Magazine *m) {
+        if (fresh_available < MAGAZINE_SIZE)
+            append_block();
+        while (m->count < MAGAZINE_SIZE) {
+            while (fresh->index == fresh->num_objects)
+                fresh = fresh->next;
+            m->objects[m->count++] = fresh->objects + fresh->index++;
+            --fresh_available;
+        }
+    }
+
+    void set_live(T *obj, bool live) {
+        Block *b = find_block(obj);
+        int i = (int)(obj - b->objects);
+        uint64_t bit = (uint64_t)1 << (i & 63);
+        if (live)
+            b->live[i >> 6].fetch_or(bit, std::memory_order_relaxed);
+        else
+            b->live[i >> 6].fetch_and(~bit, std::memory_order_relaxed);
+    }
+
+    static Magazine *new_magazine() {
+        Magazine *m = new Magazine;
+        m->count = 0;
+        return m;
+    }
+
+    static size_t bitmap_offset(int num_objects) {
+        return (HEADER_BYTES + sizeof(T)*num_objects + 7) & ~(size_t)7;
+    }
+
+    static size_t bitmap_bytes(int num_objects) {
+        return ((num_objects + 63) >> 6) * sizeof(std::atomic<uint64_t>);
+    }
+
+    int objects_in(size_t bytes) {
+        int n = (int)((bytes - HEADER_BYTES) * 8 / (sizeof(T)*8 + 1));
+        while (n > 0 && bitmap_offset(n) + bitmap_bytes(n) > bytes)
+            --n;
+        return n;
+    }
+
+    // called with the depot lock held
+    void append_block() {
+        Block *b = (Block *)aligned_malloc(block_bytes, block_bytes);
+        assert(b);
+        b->next = nullptr;
+        b->index = 0;
+        b->num_objects = objects_per_block;
+        b->objects = (T *)((char *)b + HEADER_BYTES);
+        b->live = (std::atomic<uint64_t> *)((char *)b + bitmap_offset(objects_per_block));
+        for (int w = 0; w < (objects_per_block + 63) >> 6; ++w)
+            new (b->live + w) std::atomic<uint64_t>(0);
+
+        link_block(b);
+        memstats.capacity += objects_per_block;
+        memstats.bytes += block_bytes;
+        if (!fresh_available)
+            fresh = b;
+        fresh_available += objects_per_block;
+    }
+
+    // called with the depot lock held
+    void note_live() {
+        memstats.set_live(size());
+    }
+
+    void link_block(Block *b) {
+        if (last)
+            last->next = b;
+        else
+            first = b;
+        last = b;
+        ++num_blocks;
+    }
+
+    Block *find_block(T *obj) {
+        Block *b = (Block *)((uintptr_t)obj & ~(uintptr_t)(block_bytes - 1));
+        assert(obj >= b->objects && obj < b->objects + b->num_objects && "object not allocated from this pool!");
+        return b;
+    }
+
+    MemoryStatsEntry memstats; // what memory_stats() returns
+    size_t block_bytes;
+    int objects_per_block;
+    ThreadCache *caches; // by thread index, the last one shared by the rest
+    std::mutex overflow_mutex; // for the shared cache
+
+    // the depot, and the blocks magazines are filled from
+    std::mutex depot_mutex;
+    std::vector<Magazine *> full;
+    std::vector<Magazine *> empty;
+    Block *first; // blocks in allocation order
+    Block *last;
+    Block *fresh; // first block with slots that were never handed out
+    int fresh_available; // never handed out slots, in fresh and the blocks after it
+    int num_blocks;
+    unsigned int num_exchanges;
+
+    std::atomic<int> count;
+};
+
+#endif
@@ -1,26 +1,216 @@
 #ifndef FIXED_HASHTABLE
 #define FIXED_HASHTABLE
 
+#include "util/bits.h"
+#include <type_traits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FIXED_HASHTABLE_SSE2
+#endif
+
+// Each bucket has a control byte, which is EMPTY or 7 bits of the hash of
+// the key stored there, and the key itself. A probe compares the control
+// bytes of a group of buckets at once (16, or 8 in tables smaller than
+// that) and only looks at the cached keys of those that match, so the
+// values (and Key::key) are not touched until a hit.
 template <int BucketsBits, typename T, class Key>
 class FixedHashTable {
 private:
     enum {
         HighBits = BucketsBits,
         LowBits = sizeof(unsigned int)*8 - HighBits,
-        NumBuckets = 1 << HighBits
+        NumBuckets = 1 << HighBits,
+        GroupSize = NumBuckets < 16 ? 8 : 16,
+        // the control bytes of the first buckets are repeated after the
+        // last one, so that a group can be loaded from any bucket
+        NumControl = NumBuckets + GroupSize - 1,
+        EMPTY = 0x80,
+        // keys are split into half as many displacement groups as there
+        // are buckets (see optimize)
+        DisplaceBits = HighBits > 1 ? HighBits - 1 : 1,
+        NumDisplace = 1 << DisplaceBits
     };
 
-    // random constant used in the universal hash function
+    static_assert(LowBits >= 7 + DisplaceBits, "too many buckets to take control bytes and groups from the hash");
+
+    typedef typename std::conditional<(HighBits <= 8), unsigned char, unsigned short>::type Displacement;
+
+public:
+    // what decides where keys go. a table cleared with the hash function of
+    // another, and then given the same keys in the same order, gets the
+    // same layout
+    struct HashFunction {
+        unsigned int a;
+        Displacement displace[NumDisplace];
+    };
+
+private:
+    // odd multiplier of the universal hash function
     // (http://en.wikipedia.org/wiki/Universal_hashing)
-    // we randomly generate this in order to make new hash functions until
-    // one is found which results in low max_probe (hopefully 0)
     unsigned int hash_a : LowBits;
 
     // the longest probe needed to reach any value stored in this block
     unsigned int max_probe : HighBits;
 
+    // xored into the home buckets of the keys in each group
+    Displacement displace[NumDisplace];
+
+    unsigned char control[NumControl];
+    unsigned int keys[NumBuckets];
     T buckets[NumBuckets];
 
+    unsigned int hash(unsigned int key) {
+        return hash_a * key;
+    }
+
+    // the displacement group, from the bits below the control byte ones
+    static unsigned int group(unsigned int h) {
+        return (h >> (LowBits - 7 - DisplaceBits)) & (NumDisplace - 1);
+    }
+
+    // the bucket the probe starts at, from the high bits and the
+    // displacement of the group
+    unsigned int home(unsigned int h) {
+        return (h >> LowBits) ^ displace[group(h)];
+    }
+
+    // the 7 bits below those
+    static unsigned char fragment(unsigned int h) {
+        return (unsigned char)((h >> (LowBits - 7)) & 0x7f);
+    }
+
+    void set_control(unsigned int i, unsigned char c) {
+        for (unsigned int j = i; j < NumControl; j += NumBuckets)
+            control[j] = c;
+    }
+
+    // bit k is set if the control byte of bucket (i + k) is c
+    unsigned int match(unsigned int i, unsigned char c) {
+#ifdef FIXED_HASHTABLE_SSE2
+        // a group of 8 is loaded into the low half, and the zeroes above it
+        // must not count as matches
+        __m128i group = GroupSize == 16 ?
+            _mm_loadu_si128((const __m128i *)(control + i)) :
+            _mm_loadl_epi64((const __m128i *)(control + i));
+        unsigned int bits = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)c)));
+        return bits & ((1u << GroupSize) - 1);
+#else
+        unsigned int bits = 0;
+        for (int k = 0; k < GroupSize; ++k)
+        if (control[i + k] == c)
+            bits |= 1u << k;
+        return bits;
+#endif
+    }
+
+    // index of the bucket holding key, or -1
+    int find(unsigned int key) {
+        unsigned int h = hash(key);
+        unsigned char c = fragment(h);
+        for (unsigned int p = 0; p <= max_probe; p += GroupSize) {
+            unsigned int start = (home(h) + p) & (NumBuckets - 1);
+            unsigned int bits = match(start, c);
+            // ignore the buckets past the longest probe
+            unsigned int left = max_probe - p + 1;
+            if (left < GroupSize)
+                bits &= (1u << left) - 1;
+            while (bits) {
+                unsigned int i = (start + count_trailing_zeros(bits)) & (NumBuckets - 1);
+                if (keys[i] == key)
+                    return (int)i;
+                bits &= bits - 1;
+            }
+        }
+        return -1;
+    }
+
+    // the key of val is passed in, so rehashing needs no Key::key calls
+    bool insert_key(unsigned int key, T val) {
+        int found = find(key);
+        if (found >= 0) {
+            buckets[found] = val;
+            return true;
+        }
+        unsigned int h = hash(key);
+        unsigned int p = 0;
+        do {
+            unsigned int i = (home(h) + p) & (NumBuckets - 1);
+            if (control[i] == EMPTY) {
+                set_control(i, fragment(h));
+                keys[i] = key;
+                buckets[i] = val;
+                if (p > max_probe)
+                    max_probe = p; // this probe was the longest yet
+                return true;
+            }
+        } while (++p < NumBuckets);
+        return false;
+    }
+
+
+    // find displacements which place every key at its home bucket when
+    // hashed with multiplier a, and if so rebuild the table with them
+    bool displace_all(unsigned int a) {
+        FixedHashTable temp(a);
+
+        // the home buckets of the keys before displacement, sorted by group
+        unsigned int bucket[NumBuckets];
+        int first[NumDisplace + 1] = {}; // where each group starts in bucket
+        int largest = 0;
+        for (int i = 0; i < NumBuckets; ++i)
+        if (control[i] != EMPTY)
+            ++first[group(temp.hash(keys[i])) + 1];
+        for (int g = 0; g < NumDisplace; ++g) {
+            if (first[g + 1] > largest)
+                largest = first[g + 1];
+            first[g + 1] += first[g];
+        }
+        int next[NumDisplace];
+        for (int g = 0; g < NumDisplace; ++g)
+            next[g] = first[g];
+        for (int i = 0; i < NumBuckets; ++i) {
+            if (control[i] == EMPTY)
+                continue;
+            unsigned int h = temp.hash(keys[i]);
+            bucket[next[group(h)]++] = h >> LowBits;
+        }
+
+        bool taken[NumBuckets] = {};
+        for (int size = largest; size > 0; --size)
+        for (int g = 0; g < NumDisplace; ++g) {
+            if (first[g + 1] - first[g] != size)
+                continue;
+            int d = 0;
+            while (!fits(bucket + first[g], size, d, taken)) {
+                if (++d == NumBuckets)
+                    return false;
+            }
+            temp.displace[g] = (Displacement)d;
+        }
+
+        for (int i = 0; i < NumBuckets; ++i)
+        if (control[i] != EMPTY)
+            temp.insert_key(keys[i], buckets[i]);
+        assert(temp.max_probe == 0);
+        *this = temp;
+        return true;
+    }
+
+    // whether the n buckets all turn into free (and different) ones when
+    // xored with d. if so, those are marked as taken
+    static bool fits(const unsigned int *bucket, int n, int d, bool *taken) {
+        for (int i = 0; i < n; ++i) {
+            if (taken[bucket[i] ^ d]) {
+                while (i--)
+                    taken[bucket[i] ^ d] = false;
+                return false;
+            }
+            taken[bucket[i] ^ d] = true;
+        }
+        return true;
+    }
+
 public:
     unsigned int maxprobe() {
         return max_probe;
@@ -30,92 +220,103 @@ public:
         return NumBuckets;
     }
 
+    HashFunction hash_function() {
+        HashFunction f;
+        f.a = hash_a;
+        for (int g = 0; g < NumDisplace; ++g)
+            f.displace[g] = displace[g];
+        return f;
+    }
+
     // the default was chosen by a fair dice roll. guaranteed to be random
     FixedHashTable(unsigned int hash_a = 1870964089) : hash_a(hash_a), max_probe(0) {
+        for (int g = 0; g < NumDisplace; ++g)
+            displace[g] = 0;
         clear();
     }
 
+    // a new_a other than 0 (which must be odd) replaces the multiplier, and
+    // resets the displacements
     void clear(unsigned int new_a = 0) {
-        if (new_a != 0)
+        if (new_a != 0) {
             hash_a = new_a;
+            for (int g = 0; g < NumDisplace; ++g)
+                displace[g] = 0;
+        }
         max_probe = 0;
-        for (int i = 0; i < NumBuckets; ++i)
+        for (int i = 0; i < NumControl; ++i)
+            control[i] = EMPTY;
+        for (int i = 0; i < NumBuckets; ++i) {
+            keys[i] = 0;
             buckets[i] = T();
+        }
+    }
+
+    void clear(const HashFunction &f) {
+        hash_a = f.a;
+        for (int g = 0; g < NumDisplace; ++g)
+            displace[g] = f.displace[g];
+        clear();
     }
 
     bool insert(T val) {
-        unsigned int key = Key::key(val);
-        unsigned int h = (hash_a * key) >> LowBits;
-        unsigned int p = 0;
-        do {
-            unsigned int i = (h + p) & (NumBuckets - 1);
-            if (buckets[i] == T() || Key::key(buckets[i]) == key) {
-                buckets[i] = val;
-                if (p > max_probe)
-                    max_probe = p; // this probe was the longest yet
-                return true;
-            }
-        } while (++p < NumBuckets);
-        return false;
+        return insert_key(Key::key(val), val);
     }
 
     T lookup(unsigned int key) {
-        unsigned int h = (hash_a * key) >> LowBits;
-        unsigned int p = 0;
-        do {
-            unsigned int i = (h + p) & (NumBuckets - 1);
-            T val(buckets[i]);
-            if (val != T() && Key::key(val) == key)
-                return val;
-        } while (++p <= max_probe);
-        return T();
-    }
-
-    // if you intend to insert more values after removing some, you must first
-    // rehash, or otherwise you may insert duplicates of items already in the
-    // table due to the holes left by the deletes (holes may interrupt the
-    // probe which would otherwise reach the already inserted value)
+        int i = find(key);
+        return i >= 0 ? buckets[i] : T();
+    }
+
+    // overwrite the value stored under the key of val in place. returns
+    // false if there is none
+    bool replace(T val) {
+        int i = find(Key::key(val));
+        if (i < 0)
+            return false;
+        buckets[i] = val;
+        return true;
+    }
+
+    // removing leaves a hole, and max_probe stays as long as it was. rehash
+    // after removing to get the probes back down
     T remove(unsigned int key) {
-        unsigned int h = (hash_a * key) >> LowBits;
-        unsigned int p = 0;
-        do {
-            unsigned int i = (h + p) & (NumBuckets - 1);
-            T val(buckets[i]);
-            if (val != T() && Key::key(val) == key) {
-                buckets[i] = T();
-                return val;
-            }
-        } while (++p <= max_probe);
-        return T();
+        int i = find(key);
+        if (i < 0)
+            return T();
+        T val(buckets[i]);
+        set_control(i, EMPTY);
+        buckets[i] = T();
+        return val;
     }
 
-    // rehash using randomly generated hash_a until max_probe is 0
-    // or until we run out of attempts
-    template <class RandFunc>
-    void optimize(RandFunc &rnd, int max_attempts = 1000) {
+    // Rebuild the table so that every key is in its home bucket, which makes
+    // every lookup a single probe. This is hash and displace (CHD): the keys
+    // are split into groups by hash, and each group, biggest first, is given
+    // the displacement that moves all its keys into free buckets. When some
+    // group can not be placed, the next multiplier in a fixed sequence is
+    // tried, so the result only depends on the keys and the starting
+    // multiplier. Returns false, leaving the table as it was, if none of
+    // max_attempts multipliers work. Usually the first one does.
+    bool optimize(int max_attempts = 16) {
         if (max_probe == 0)
-            return; // already optimal
-        
-        FixedHashTable temp(*this);
+            return true; // already optimal
 
+        unsigned int a = hash_a;
         for (int attempt = 0; attempt < max_attempts; ++attempt) {
-            // rehash using new random hash_a (which must be positive and odd)
-            temp.rehash(((unsigned int)rnd() & ~(unsigned int)1) + 1);
-
-            if (temp.max_probe < max_probe) {
-                *this = temp;
-                if (temp.max_probe == 0)
-                    break; // perfect; no point looking any more
-            }
+            if (displace_all(a))
+                return true;
+            a = (a + 0x9e3779b9u) | 1; // the fractional golden ratio, odd
         }
+        return false;
     }
 
     void rehash(unsigned int new_a = 0) {
         FixedHashTable temp(*this);
         clear(new_a);
         for (int i = 0; i < NumBuckets; ++i)
-        if (temp.buckets[i] != T())
-            insert(temp.buckets[i]);
+        if (temp.control[i] != EMPTY)
+            insert_key(temp.keys[i], temp.buckets[i]);
     }
 
 
@@ -0,0 +1,92 @@
+#ifndef FIXEDVECTOR_H
+#define FIXEDVECTOR_H
+
+#include <cassert>
+#include <new>
+#include <utility>
+#include <type_traits>
+
+// A vector of at most N elements, stored inline. It never allocates, so
+// it suits short lists kept in components, which then sit next to the
+// rest of the component's data.
+template <class T, int N>
+class FixedVector {
+public:
+    typedef T value_type;
+    typedef T *iterator;
+    typedef const T *const_iterator;
+
+    FixedVector() : count(0) {}
+
+    ~FixedVector() {
+        clear();
+    }
+
+    FixedVector(const FixedVector &v) : count(0) {
+        for (int i = 0; i < v.count; ++i)
+            push_back(v[i]);
+    }
+
+    // spelled out since VS2013 does not generate move constructors
+    FixedVector(FixedVector &&v) : count(0) {
+        for (int i = 0; i < v.count; ++i)
+            push_back(std::move(v[i]));
+        v.clear();
+    }
+
+    FixedVector &operator=(const FixedVector &v) {
+        if (this != &v) {
+            clear();
+            for (int i = 0; i < v.count; ++i)
+                push_back(v[i]);
+        }
+        return *this;
+    }
+
+    void push_back(const T &val) {
+        assert(count < N);
+        new (data() + count)T(val);
+        ++count;
+    }
+
+    void push_back(T &&val) {
+        assert(count < N);
+        new (data() + count)T(std::move(val));
+        ++count;
+    }
+
+    void pop_back() {
+        assert(count > 0);
+        data()[--count].~T();
+    }
+
+    void clear() {
+        while (count)
+            data()[--count].~T();
+    }
+
+    int size() const { return count; }
+    int capacity() const { return N; }
+    bool empty() const { return count == 0; }
+    bool full() const { return count == N; }
+
+    T &operator[](int i) { assert(i >= 0 && i < count); return data()[i]; }
+    const T &operator[](int i) const { assert(i >= 0 && i < count); return data()[i]; }
+
+    T &back() { assert(count > 0); return data()[count - 1]; }
+    const T &back() const { assert(count > 0); return data()[count - 1]; }
+
+    iterator begin() { return data(); }
+    iterator end() { return data() + count; }
+    const_iterator begin() const { return data(); }
+    const_iterator end() const { return data() + count; }
+
+private:
+    T *data() { return (T *)storage; }
+    const T *data() const { return (const T *)storage; }
+
+    typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type storage[N];
+    int count;
+};
+
+#endif
@@ -0,0 +1,122 @@
+#include "hugepageslab.h"
+#include "pool.h"
+#include <cassert>
+#include <cstdint>
+#include <new>
+
+#ifdef WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+HugePageSlab::HugePageSlab(size_t block_bytes) :
+    block_bytes(block_bytes),
+    region_used(REGION_BYTES),
+    num_free(0)
+{
+    assert(block_bytes > 0 && block_bytes <= REGION_BYTES);
+    assert(!(block_bytes & (block_bytes - 1)) && "block size must be a power of two");
+}
+
+HugePageSlab::~HugePageSlab() {
+    for (Region &r : regions) {
+        if (!r.mapped)
+            aligned_free(r.data);
+        else
+#ifdef WIN32
+            VirtualFree(r.data, 0, MEM_RELEASE);
+#else
+            munmap(r.data, REGION_BYTES);
+#endif
+    }
+}
+
+void *HugePageSlab::alloc() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!num_free)
+        map_region();
+    --num_free;
+    if (free_blocks.size()) {
+        void *block = free_blocks.back();
+        free_blocks.pop_back();
+        return block;
+    }
+    void *block = regions.back().data + region_used;
+    region_used += block_bytes;
+    return block;
+}
+
+void HugePageSlab::free(void *block) {
+    std::lock_guard<std::mutex> lock(mutex);
+    assert(!((uintptr_t)block & (block_bytes - 1)));
+    free_blocks.push_back(block);
+    ++num_free;
+}
+
+void HugePageSlab::reserve(int num_blocks) {
+    std::lock_guard<std::mutex> lock(mutex);
+    while (num_free < num_blocks)
+        map_region();
+}
+
+int HugePageSlab::num_regions() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return (int)regions.size();
+}
+
+int HugePageSlab::num_huge_regions() {
+    std::lock_guard<std::mutex> lock(mutex);
+    int n = 0;
+    for (Region &r : regions)
+        n += r.huge;
+    return n;
+}
+
+void HugePageSlab::map_region() {
+    // whatever is left of the last region goes to the free list, so that
+    // carving only ever happens in the newest one
+    if (regions.size()) {
+        for (; region_used < REGION_BYTES; region_used += block_bytes)
+            free_blocks.push_back(regions.back().data + region_used);
+    }
+
+    Region r;
+#ifdef WIN32
+    // needs SeLockMemoryPrivilege, which most users lack
+    r.data = nullptr;
+    SIZE_T large = GetLargePageMinimum();
+    if (large && REGION_BYTES % large == 0)
+        r.data = (char *)VirtualAlloc(nullptr, REGION_BYTES, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+    r.huge = r.mapped = r.data != nullptr;
+#else
+    // map twice the size and cut off the ends, to get an aligned region
+    size_t bytes = 2*REGION_BYTES;
+    char *p = (char *)mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    r.data = nullptr;
+    r.huge = false;
+    r.mapped = p != MAP_FAILED;
+    if (r.mapped) {
+        char *aligned = (char *)(((uintptr_t)p + REGION_BYTES - 1) & ~(uintptr_t)(REGION_BYTES - 1));
+        if (aligned > p)
+            munmap(p, aligned - p);
+        if (aligned + REGION_BYTES < p + bytes)
+            munmap(aligned + REGION_BYTES, p + bytes - (aligned + REGION_BYTES));
+        r.data = aligned;
+#ifdef MADV_HUGEPAGE
+        r.huge = madvise(r.data, REGION_BYTES, MADV_HUGEPAGE) == 0;
+#else
+        r.huge = false;
+#endif
+    }
+#endif
+    // without a mapping the region is an ordinary allocation, and without
+    // that there is nothing to hand out
+    if (!r.data)
+        r.data = (char *)aligned_malloc(REGION_BYTES, REGION_BYTES);
+    if (!r.data)
+        throw std::bad_alloc();
+    regions.push_back(r);
+    region_used = 0;
+    num_free = (int)free_blocks.size() + (int)(REGION_BYTES / block_bytes);
+}
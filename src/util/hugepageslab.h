@@ -0,0 +1,59 @@
+#ifndef HUGEPAGESLAB_H
+#define HUGEPAGESLAB_H
+
+#include <vector>
+#include <mutex>
+#include <cstddef>
+
+// Hands out blocks of one size, a power of two up to REGION_BYTES, each
+// aligned to its size. Blocks are carved from REGION_BYTES regions which
+// are backed by huge pages where the system allows it (transparent huge
+// pages on Linux, large pages on Windows if the process may lock memory),
+// so that walking pools made of them takes far fewer TLB entries. Where
+// huge pages are not available the regions are plain aligned allocations.
+//
+// Freed blocks are kept for reuse. Regions are only given back when the
+// slab is destroyed, so it must outlive the pools using it. Several pools
+// may share a slab, also from different threads. alloc and reserve throw
+// std::bad_alloc when no region can be had.
+class HugePageSlab {
+public:
+    enum { REGION_BYTES = 2*1024*1024 };
+
+    explicit HugePageSlab(size_t block_bytes);
+    ~HugePageSlab();
+
+    size_t block_size() { return block_bytes; }
+
+    void *alloc();
+    void free(void *block);
+
+    // map regions up front, so that num_blocks blocks can be handed out
+    // without going to the system
+    void reserve(int num_blocks);
+
+    int num_regions();
+    int num_huge_regions(); // the ones that huge pages were asked for
+
+private:
+    // non-copyable
+    HugePageSlab(const HugePageSlab &);
+    HugePageSlab &operator=(const HugePageSlab &);
+
+    struct Region {
+        char *data;
+        bool huge;
+        bool mapped; // from mmap/VirtualAlloc rather than aligned_malloc
+    };
+
+    void map_region(); // called with the lock held
+
+    size_t block_bytes;
+    std::mutex mutex;
+    std::vector<Region> regions;
+    std::vector<void *> free_blocks;
+    size_t region_used; // bytes carved from the last region
+    int num_free; // free_blocks plus what is left in the last region
+};
+
+#endif
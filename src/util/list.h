@@ -2,17 +2,26 @@
 #define INTRUSIVE_H
 
 #include <cstdint>
+#include <type_traits>
 #include "listlink.h"
 
 template <class T, ListLink T::*LinkField>
 class List {
 	ListLink head;
 
+	// offset of the link in T, taken on a suitably aligned address rather
+	// than by dereferencing a null T pointer
+	static intptr_t link_offset() {
+		static typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type dummy;
+		const T *t = (const T *)&dummy;
+		return (const char *)&(t->*LinkField) - (const char *)t;
+	}
+
 	static T *value_of(ListLink *link) {
-		return (T *)((char *)link - (intptr_t)&(((T *)0)->*LinkField));
+		return (T *)((char *)link - link_offset());
 	}
 	static const T *value_of(const ListLink *link) {
-		return (const T *)((const char *)link - (intptr_t)&(((T *)0)->*LinkField));
+		return (const T *)((const char *)link - link_offset());
 	}
 
 public:
@@ -22,9 +31,19 @@ public:
 	List() : head(&head, &head) {}
 	~List() { clear(); }
 
+	// walk the chain once rather than unlinking head.next until empty. gcc
+	// -O2 kept head.next in a register across the unlinks when destroying
+	// arrays of lists (as in HashTable), and never left the loop
 	void clear() {
-		while (head.next != &head)
-			head.next->unlink();
+		ListLink *link = head.next;
+		while (link != &head) {
+			ListLink *next = link->next;
+			link->prev = 0;
+			link->next = 0;
+			link = next;
+		}
+		head.prev = &head;
+		head.next = &head;
 	}
 
 	void push_front(T *value) {
@@ -14,6 +14,15 @@ public:
 	ListLink() : prev(0), next(0) {}
 	~ListLink() { unlink(); }
 
+	// take over the position of link in its list, leaving link unlinked
+	ListLink(ListLink &&link) : prev(link.prev), next(link.next) {
+		assert(prev != &link); // not for list heads
+		if (prev) prev->next = this;
+		if (next) next->prev = this;
+		link.prev = 0;
+		link.next = 0;
+	}
+
 	void unlink() {
 		if (prev) prev->next = next;
 		if (next) next->prev = prev;
@@ -0,0 +1,46 @@
+#include "memstats.h"
+#include "list.h"
+#include <mutex>
+
+class MemoryStatsRegistry {
+public:
+    std::mutex mutex;
+    List<MemoryStatsEntry, &MemoryStatsEntry::link> entries;
+
+    // created on first use, so entries may be defined in any file
+    static MemoryStatsRegistry &get() {
+        static MemoryStatsRegistry registry;
+        return registry;
+    }
+};
+
+MemoryStatsEntry::MemoryStatsEntry(const char *n) {
+    name = n;
+    live = 0;
+    capacity = 0;
+    peak = 0;
+    bytes = 0;
+    MemoryStatsRegistry &r = MemoryStatsRegistry::get();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.entries.push_back(this);
+}
+
+MemoryStatsEntry::~MemoryStatsEntry() {
+    MemoryStatsRegistry &r = MemoryStatsRegistry::get();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    link.unlink();
+}
+
+void for_each_memory_stats(std::function<void(const MemoryStats &)> func) {
+    MemoryStatsRegistry &r = MemoryStatsRegistry::get();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for (MemoryStatsEntry *e : r.entries)
+        func(*e);
+}
+
+void dump_memory_stats(FILE *f) {
+    fprintf(f, "%-24s %10s %10s %10s %12s\n", "allocator", "live", "capacity", "peak", "bytes");
+    for_each_memory_stats([f](const MemoryStats &s) {
+        fprintf(f, "%-24s %10d %10d %10d %12lu\n", s.name, s.live, s.capacity, s.peak, (unsigned long)s.bytes);
+    });
+}
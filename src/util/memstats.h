@@ -0,0 +1,58 @@
+#ifndef MEMSTATS_H
+#define MEMSTATS_H
+
+#include "listlink.h"
+#include <functional>
+#include <cstddef>
+#include <cstdio>
+
+// what an allocator holds. pools count objects in live, capacity and peak,
+// arenas count bytes
+struct MemoryStats {
+    const char *name;
+    int live; // in use now
+    int capacity; // usable without allocating more
+    int peak; // highest live so far
+    size_t bytes; // memory held from the system
+};
+
+// the stats of one allocator, listed in a global registry while it exists.
+// allocators keep one of these and update it as they go. the counters are
+// not synchronized, so read them while the allocators are idle (between frames)
+class MemoryStatsEntry : public MemoryStats {
+public:
+    explicit MemoryStatsEntry(const char *name);
+    ~MemoryStatsEntry();
+
+    void set_name(const char *n) { name = n; } // n must outlive the entry
+
+    void add_live(int n) {
+        live += n;
+        if (live > peak)
+            peak = live;
+    }
+
+    void set_live(int n) {
+        live = n;
+        if (live > peak)
+            peak = live;
+    }
+
+    void reset_peak() { peak = live; }
+
+private:
+    // non-copyable
+    MemoryStatsEntry(const MemoryStatsEntry &);
+    MemoryStatsEntry &operator=(const MemoryStatsEntry &);
+
+    friend class MemoryStatsRegistry;
+    ListLink link;
+};
+
+// call func for each registered allocator, in order of registration
+void for_each_memory_stats(std::function<void(const MemoryStats &)> func);
+
+// print a line per allocator
+void dump_memory_stats(FILE *f = stdout);
+
+#endif
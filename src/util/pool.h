@@ -5,17 +5,39 @@
 #include <cassert>
 #include <malloc.h>
 #include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
+#include "util/bits.h"
+#include "util/hugepageslab.h"
+#include "util/memstats.h"
 
 template <class T>
 class Pool {
+    // a free object's storage holds the link to the next free one, so
+    // freeing never allocates
+    union Slot {
+        Slot *next_free;
+        typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type storage;
+    };
+
     struct Block {
         Block *next;
         int num_objects;
-        T *objects;
+        Slot *slots;
+    };
+
+    enum {
+        SLOT_ALIGN = std::alignment_of<Slot>::value,
+        HEADER_BYTES = (sizeof(Block) + SLOT_ALIGN - 1) & ~(SLOT_ALIGN - 1)
     };
 
 public:
-    Pool(int initial_size = 16) :
+    Pool(int initial_size = 16, const char *name = "Pool") :
+        stats(name),
+        freelist(nullptr),
         blocks(new_block(nullptr, initial_size)),
         block_index(0) {}
 
@@ -30,204 +52,532 @@ public:
     template<typename ...Args>
     T *create(Args&&... params) {
         T *obj = alloc();
+        stats.add_live(1);
         return new (obj)T(std::forward<Args>(params)...);
     }
 
     void free(T *obj) {
         obj->~T();
-        freelist.push_back(obj);
+        stats.add_live(-1);
+        Slot *s = (Slot *)obj;
+        s->next_free = freelist;
+        freelist = s;
+    }
+
+    // Release the blocks in which every object has been freed. The block
+    // new objects are taken from is kept, but rewound if it is all free.
+    // This walks the whole freelist, so call it once the pool has shrunk
+    // (e.g. after a level or a compaction) rather than every frame.
+    void trim() {
+        std::vector<Block *> sorted; // by address, to find a slot's block
+        for (Block *b = blocks; b; b = b->next)
+            sorted.push_back(b);
+        std::sort(sorted.begin(), sorted.end());
+
+        std::vector<int> num_free(sorted.size(), 0);
+        for (Slot *s = freelist; s; s = s->next_free)
+            ++num_free[block_of(sorted, s)];
+
+        std::vector<char> release(sorted.size(), 0);
+        bool any = false;
+        for (size_t i = 0; i < sorted.size(); ++i) {
+            Block *b = sorted[i];
+            int used = b == blocks ? block_index : b->num_objects;
+            if (used && num_free[i] == used) {
+                release[i] = 1;
+                any = true;
+            }
+        }
+        if (!any)
+            return;
+
+        // drop the slots of released blocks from the freelist
+        Slot **link = &freelist;
+        while (*link) {
+            if (release[block_of(sorted, *link)])
+                *link = (*link)->next_free;
+            else
+                link = &(*link)->next_free;
+        }
+
+        Block **bp = &blocks->next;
+        while (*bp) {
+            Block *b = *bp;
+            if (release[block_of(sorted, b->slots)]) {
+                *bp = b->next;
+                stats.capacity -= b->num_objects;
+                stats.bytes -= block_size(b->num_objects);
+                ::free(b);
+            } else {
+                bp = &b->next;
+            }
+        }
+        if (release[block_of(sorted, blocks->slots)])
+            block_index = 0;
     }
 
+    const MemoryStats &memory_stats() { return stats; }
+    void set_name(const char *name) { stats.set_name(name); }
+
 private:
     T *alloc() {
-        if (freelist.size()) {
-            T *obj = freelist.back();
-            freelist.pop_back();
-            return obj;
+        if (freelist) {
+            Slot *s = freelist;
+            freelist = s->next_free;
+            return (T *)s;
         }
         if (block_index == blocks->num_objects) {
             blocks = new_block(blocks, blocks->num_objects * 2);
             block_index = 0;
         }
-        return &blocks->objects[block_index++];
+        return (T *)&blocks->slots[block_index++];
     }
 
     Block *new_block(Block *next, int num_objects) {
         assert(num_objects > 0);
-        Block *b = (Block *)::malloc(sizeof(Block)+sizeof(T)*num_objects);
+        Block *b = (Block *)::malloc(block_size(num_objects));
         b->next = next;
         b->num_objects = num_objects;
-        b->objects = (T *)((char *)b + sizeof(Block));
+        b->slots = (Slot *)((char *)b + HEADER_BYTES);
+        stats.capacity += num_objects;
+        stats.bytes += block_size(num_objects);
         return b;
     }
 
-    std::vector<T *> freelist;
-    Block *blocks;
+    static size_t block_size(int num_objects) {
+        return HEADER_BYTES + sizeof(Slot)*num_objects;
+    }
+
+    // index in sorted of the block that s lives in
+    static size_t block_of(const std::vector<Block *> &sorted, Slot *s) {
+        size_t i = std::upper_bound(sorted.begin(), sorted.end(), (Block *)s) - sorted.begin();
+        assert(i > 0);
+        return i - 1;
+    }
+
+    MemoryStatsEntry stats; // before blocks, which new_block counts in it
+    Slot *freelist;
+    Block *blocks; // the block new objects are taken from comes first
     int block_index;
 };
 
 
-template <class T>
-class IterablePool {
-    typedef std::vector<T *> Freelist;
+// Allocation aligned to align, which must be a power of two. Memory from
+// aligned_malloc must be released with aligned_free.
+inline void *aligned_malloc(size_t size, size_t align) {
+#ifdef WIN32
+    return _aligned_malloc(size, align);
+#else
+    void *p;
+    if (posix_memalign(&p, align, size))
+        return nullptr;
+    return p;
+#endif
+}
 
-    struct Block {
-        Block *next;
-        int index;
-        int num_objects;
-        char *livemap;
-        T *objects;
-        Freelist freelist;
+inline void aligned_free(void *p) {
+#ifdef WIN32
+    _aligned_free(p);
+#else
+    ::free(p);
+#endif
+}
 
-        T *freelist_alloc() {
-            if (freelist.empty())
-                return nullptr;
-            T *obj = freelist.back();
-            freelist.pop_back();
-            livemap[obj - objects] = 1;
-            return obj;
-        }
-    };
 
+// The pools below keep their objects in blocks that each have a bitmap
+// with one bit per object, set while the object is live. Block must have
+// next, objects, live (an array of 64 bit words, plain or atomic) and
+// num_words(), the number of bitmap words in use.
+
+// visits the live objects by walking the set bits of each bitmap word
+template <class T, class Block>
+class BlockIterator {
 public:
     typedef T *value_type;
 
-    class iterator {
-    public:
-        typedef T *value_type;
+    explicit BlockIterator(Block *block) : block(block), index(-1), word(-1), num_words(0), bits(0) {
+        if (block) {
+            num_words = block->num_words();
+            ++*this;
+        }
+    }
 
-        T *operator*() { return block->objects + index; }
-        T *operator->() { return block->objects + index; }
+    T *operator*() { return block->objects + index; }
+    T *operator->() { return block->objects + index; }
 
-        bool operator==(iterator it) const { return index == it.index && block == it.block; }
-        bool operator!=(iterator it) const { return !(*this == it); }
+    bool operator==(BlockIterator it) const { return index == it.index && block == it.block; }
+    bool operator!=(BlockIterator it) const { return !(*this == it); }
 
-        iterator &operator++() {
-            while (block) {
-                if (++index >= block->index) {
+    BlockIterator &operator++() {
+        bits &= bits - 1; // clear the current object
+        while (!bits) {
+            if (++word >= num_words) {
+                block = block ? block->next : nullptr;
+                if (!block) {
                     index = -1;
-                    block = block->next;
-                } else if (block->livemap[index]) {
-                    break;
+                    return *this;
                 }
+                word = 0;
+                num_words = block->num_words();
+                if (!num_words)
+                    continue;
             }
-            return *this;
+            bits = block->live[word];
         }
+        index = (word << 6) + count_trailing_zeros(bits);
+        return *this;
+    }
 
-        iterator operator++(int) {
-            iterator it(*this);
-            ++*this;
-            return it;
+    BlockIterator operator++(int) {
+        BlockIterator it(*this);
+        ++*this;
+        return it;
+    }
+
+private:
+    Block *block;
+    int index;
+    int word;
+    int num_words;
+    uint64_t bits; // live objects in word not visited yet
+};
+
+// call func(T *objects, int n) for each run of consecutive live objects in
+// the blocks starting at first, in iteration order
+template <class Block, class Func>
+void for_each_block_span(Block *first, Func func) {
+    for (Block *b = first; b; b = b->next) {
+        int start = 0, len = 0; // the run being built
+        int num_words = b->num_words();
+        for (int w = 0; w < num_words; ++w) {
+            uint64_t bits = b->live[w];
+            int base = w << 6;
+            while (bits) {
+                int i = count_trailing_zeros(bits);
+                uint64_t rest = ~(bits >> i);
+                int n = rest ? count_trailing_zeros(rest) : 64 - i;
+                if (len && start + len == base + i) {
+                    len += n;
+                } else {
+                    if (len)
+                        func(b->objects + start, len);
+                    start = base + i;
+                    len = n;
+                }
+                bits = i + n < 64 ? bits & (~(uint64_t)0 << (i + n)) : 0;
+            }
         }
-    private:
-        friend class IterablePool;
+        if (len)
+            func(b->objects + start, len);
+    }
+}
+
+// Move the live objects of blocks (n objects each) into the lowest free
+// slots, numbering slots across the blocks in order, until they are packed
+// at the front. Each object is move constructed at its new slot, then
+// relocate(from, to) is called, then the old one is destroyed.
+template <class T, class Block, class Func>
+void pack_blocks(const std::vector<Block *> &blocks, int n, Func &relocate) {
+    // dst walks up over the holes, src walks down over the live objects,
+    // until they meet
+    int dst = 0;
+    int src = (int)blocks.size() * n - 1;
+    for (;;) {
+        while (dst < src && blocks[dst / n]->is_live(dst % n))
+            ++dst;
+        while (src > dst && !blocks[src / n]->is_live(src % n))
+            --src;
+        if (dst >= src)
+            break;
+
+        Block *db = blocks[dst / n];
+        Block *sb = blocks[src / n];
+        int di = dst % n;
+        int si = src % n;
+        T *from = sb->objects + si;
+        T *to = db->objects + di;
+        new (to)T(std::move(*from));
+        relocate(from, to);
+        from->~T();
+        db->live[di >> 6] |= (uint64_t)1 << (di & 63);
+        sb->live[si >> 6] &= ~((uint64_t)1 << (si & 63));
+    }
+}
 
-        iterator(Block *block, int index) : block(block), index(index) {
-            ++*this;
+
+template <class T>
+class IterablePool {
+    // Blocks are all block_bytes in size and aligned to that (a power of
+    // two), so the block an object lives in is found by masking its address.
+    // The header comes first, then the objects, then the occupancy bitmap.
+    struct Block {
+        Block *next;
+        Block *next_free; // next block with freed objects
+        int index; // objects below this have been handed out at some point
+        int num_objects;
+        int num_free; // freed objects below index
+        int free_hint; // no free objects in the words below this
+        uint64_t *live; // one bit per object
+        T *objects;
+
+        int num_words() { return (index + 63) >> 6; }
+
+        bool is_live(int i) {
+            return (live[i >> 6] >> (i & 63)) & 1;
+        }
+
+        T *freelist_alloc() {
+            assert(num_free > 0);
+            for (int w = free_hint; ; ++w) {
+                assert(w < num_words());
+                uint64_t dead = ~live[w];
+                if (dead) {
+                    int i = (w << 6) + count_trailing_zeros(dead);
+                    assert(i < index);
+                    live[w] |= (uint64_t)1 << (i & 63);
+                    free_hint = w;
+                    --num_free;
+                    return objects + i;
+                }
+            }
         }
+    };
 
-        Block *block;
-        int index;
+    enum {
+        MIN_BLOCK_BYTES = 16*1024,
+        MIN_BLOCK_OBJECTS = 8,
+        HEADER_BYTES = (sizeof(Block) + 15) & ~15
     };
 
-    iterator begin() { return iterator(blocks, -1); }
-    iterator end() { return iterator(nullptr, -1); }
+public:
+    typedef T *value_type;
 
-    IterablePool(int initial_size = 16) :
-        freelist_block(nullptr),
-        blocks(new_block(nullptr, initial_size)),
+    typedef BlockIterator<T, Block> iterator;
+
+    iterator begin() { return iterator(first); }
+    iterator end() { return iterator(nullptr); }
+
+    // block_bytes is the size of each block, a power of two. 0 picks the
+    // smallest one from MIN_BLOCK_BYTES up that holds MIN_BLOCK_OBJECTS.
+    // Blocks come from slab if given (and are its size), or else the heap.
+    IterablePool(int initial_size = 16, size_t block_bytes = 0, HugePageSlab *slab = nullptr, const char *name = "IterablePool") :
+        stats(name),
+        block_bytes(block_bytes),
+        slab(slab),
+        first(nullptr),
+        last(nullptr),
+        fresh(nullptr),
+        fresh_available(0),
+        free_blocks(nullptr),
         count(0)
-    {}
+    {
+        if (slab) {
+            assert(!block_bytes || block_bytes == slab->block_size());
+            this->block_bytes = slab->block_size();
+        } else if (!block_bytes) {
+            this->block_bytes = MIN_BLOCK_BYTES;
+            while (objects_in(this->block_bytes) < MIN_BLOCK_OBJECTS)
+                this->block_bytes *= 2;
+        }
+        assert(!(this->block_bytes & (this->block_bytes - 1)) && "block size must be a power of two");
+        objects_per_block = objects_in(this->block_bytes);
+        assert(objects_per_block > 0);
+        reserve(initial_size);
+    }
 
     ~IterablePool() {
         if (count) {
             for (T *obj : *this)
                 obj->~T();
         }
-        while (blocks) {
-            Block *next = blocks->next;
-            (blocks->freelist).~Freelist();
-            ::free(blocks);
-            blocks = next;
+        while (first) {
+            Block *next = first->next;
+            free_block(first);
+            first = next;
         }
     }
 
     template<typename ...Args>
     T *create(Args&&... params) {
         ++count;
+        stats.add_live(1);
         T *obj = alloc();
         return new (obj)T(std::forward<Args>(params)...);
     }
 
     void free(T *obj) {
         --count;
+        stats.add_live(-1);
         assert(count >= 0);
         obj->~T();
         Block *b = find_block(obj);
-        b->freelist.push_back(obj);
-        char &alive = b->livemap[obj - b->objects];
-        assert(alive);
-        alive = 0;
-        if (!freelist_block)
-            freelist_block = b;
+        int i = (int)(obj - b->objects);
+        assert(b->is_live(i));
+        b->live[i >> 6] &= ~((uint64_t)1 << (i & 63));
+        if ((i >> 6) < b->free_hint)
+            b->free_hint = i >> 6;
+        if (b->num_free++ == 0) {
+            b->next_free = free_blocks;
+            free_blocks = b;
+        }
     }
 
     int size() {
         return count;
     }
 
-private:
-    T *alloc() {
-        if (freelist_block) {
-            T *obj = freelist_block->freelist_alloc();
-            if (obj)
-                return obj;
-            freelist_block = blocks;
-            while (freelist_block) {
-                obj = freelist_block->freelist_alloc();
-                if (obj)
-                    return obj;
-                freelist_block = freelist_block->next;
+    int block_objects() {
+        return objects_per_block;
+    }
+
+    const MemoryStats &memory_stats() { return stats; }
+    void set_name(const char *name) { stats.set_name(name); }
+
+    // Call func(T *objects, int n) for each run of consecutive live objects,
+    // in iteration order. Lets systems work on plain arrays instead of
+    // stepping an iterator, which pays off when the pool is dense.
+    template <class Func>
+    void for_each_span(Func func) {
+        for_each_block_span(first, func);
+    }
+
+    // make sure that at least n more objects can be created without
+    // allocating. freed slots are still used first, so the objects are not
+    // necessarily adjacent
+    void reserve(int n) {
+        while (fresh_available < n)
+            append_block();
+    }
+
+    // Move the live objects into a dense prefix of the blocks, in block
+    // order, and free the blocks that end up empty. Objects are taken from
+    // the back and move constructed into the lowest holes; relocate(T *from,
+    // T *to) is called for each one before *from is destroyed, so that
+    // whatever points at it can be redirected. Nothing may create or free
+    // objects in the pool while this runs. Iteration order is not kept.
+    template <class Func>
+    void compact(Func relocate) {
+        std::vector<Block *> blocks;
+        for (Block *b = first; b; b = b->next)
+            blocks.push_back(b);
+        int n = objects_per_block;
+        pack_blocks<T>(blocks, n, relocate);
+
+        // the first count slots are live now. the slots after them become
+        // fresh again, and blocks without live objects are released
+        first = last = fresh = nullptr;
+        fresh_available = 0;
+        free_blocks = nullptr;
+        for (size_t k = 0; k < blocks.size(); ++k) {
+            Block *b = blocks[k];
+            int live = count - (int)k * n;
+            if (live <= 0) {
+                free_block(b);
+                continue;
+            }
+            if (live > n)
+                live = n;
+            b->next = nullptr;
+            b->index = live;
+            b->num_free = 0;
+            b->free_hint = 0;
+            if (last)
+                last->next = b;
+            else
+                first = b;
+            last = b;
+            if (live < n) {
+                fresh = b;
+                fresh_available = n - live;
             }
         }
+    }
 
-        if (blocks->index == blocks->num_objects) {
-            blocks = new_block(blocks, blocks->num_objects * 2);
+private:
+    T *alloc() {
+        if (free_blocks) {
+            Block *b = free_blocks;
+            T *obj = b->freelist_alloc();
+            if (!b->num_free)
+                free_blocks = b->next_free;
+            return obj;
         }
 
-        T *obj = &blocks->objects[blocks->index];
-        blocks->livemap[blocks->index++] = 1;
-        return obj;
+        if (!fresh_available)
+            append_block();
+        while (fresh->index == fresh->num_objects)
+            fresh = fresh->next;
+
+        --fresh_available;
+        int i = fresh->index++;
+        fresh->live[i >> 6] |= (uint64_t)1 << (i & 63);
+        return &fresh->objects[i];
     }
 
-    Block *new_block(Block *next, int num_objects) {
-        assert(num_objects > 0);
-        assert(!next || (next->index == next->num_objects));
-        int livemap_offset = sizeof(Block)+sizeof(T)*num_objects;
-        Block *b = (Block *)::malloc(livemap_offset + num_objects);
-        b->next = next;
+    static size_t bitmap_offset(int num_objects) {
+        return (HEADER_BYTES + sizeof(T)*num_objects + 7) & ~(size_t)7;
+    }
+
+    static size_t bitmap_bytes(int num_objects) {
+        return ((num_objects + 63) >> 6) * sizeof(uint64_t);
+    }
+
+    int objects_in(size_t bytes) {
+        int n = (int)((bytes - HEADER_BYTES) * 8 / (sizeof(T)*8 + 1));
+        while (n > 0 && bitmap_offset(n) + bitmap_bytes(n) > bytes)
+            --n;
+        return n;
+    }
+
+    void append_block() {
+        Block *b = (Block *)(slab ? slab->alloc() : aligned_malloc(block_bytes, block_bytes));
+        assert(b);
+        b->next = nullptr;
+        b->next_free = nullptr;
         b->index = 0;
-        b->num_objects = num_objects;
-        b->objects = (T *)((char *)b + sizeof(Block));
-        b->livemap = (char *)b + livemap_offset;
-        memset(b->livemap, 0, num_objects);
-        new (&b->freelist) Freelist;
-        return b;
+        b->num_objects = objects_per_block;
+        b->num_free = 0;
+        b->free_hint = 0;
+        b->objects = (T *)((char *)b + HEADER_BYTES);
+        b->live = (uint64_t *)((char *)b + bitmap_offset(objects_per_block));
+        memset(b->live, 0, bitmap_bytes(objects_per_block));
+        stats.capacity += objects_per_block;
+        stats.bytes += block_bytes;
+
+        if (last)
+            last->next = b;
+        else
+            first = b;
+        last = b;
+        if (!fresh_available)
+            fresh = b;
+        fresh_available += objects_per_block;
     }
 
     Block *find_block(T *obj) {
-        Block *b = blocks;
-        while (b) {
-            if (obj >= b->objects && obj < b->objects + b->num_objects)
-                return b;
-            b = b->next;
-        }
-        assert(0 && "object not allocated from this pool!");
-        return nullptr;
+        Block *b = (Block *)((uintptr_t)obj & ~(uintptr_t)(block_bytes - 1));
+        assert(obj >= b->objects && obj < b->objects + b->num_objects && "object not allocated from this pool!");
+        return b;
+    }
+
+    void free_block(Block *b) {
+        stats.capacity -= objects_per_block;
+        stats.bytes -= block_bytes;
+        if (slab)
+            slab->free(b);
+        else
+            aligned_free(b);
     }
 
-    Block *freelist_block;
-    Block *blocks;
+    MemoryStatsEntry stats;
+    size_t block_bytes;
+    HugePageSlab *slab; // where blocks come from, unless null
+    int objects_per_block;
+    Block *first; // blocks in allocation order
+    Block *last;
+    Block *fresh; // first block with slots that were never used
+    int fresh_available; // never used slots, in fresh and the blocks after it
+    Block *free_blocks; // blocks with freed objects, linked by next_free
     int count;
 };
 
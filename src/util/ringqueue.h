@@ -0,0 +1,379 @@
+#ifndef RINGQUEUE_H
+#define RINGQUEUE_H
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <utility>
+#include <cassert>
+
+// Bounded queues of T (which must be default constructible) in a ring
+// buffer whose size is a power of two. The try_ functions never block or
+// take a lock. push and pop block until they can go ahead, but the lock
+// they sleep under is only taken by the other side if someone sleeps.
+//
+// The indices written by each side are on cache lines of their own, so the
+// producers and the consumer don't slow each other down until the queue
+// runs nearly empty or full.
+
+
+// Lets threads sleep until some condition that is changed without a lock
+// (e.g. queue not empty) may have become true. A waiter calls
+// prepare_wait(), checks the condition again, and then calls either
+// cancel_wait() or wait(). Whoever changes the condition calls notify(),
+// which costs a fence and a load when nobody is waiting.
+class EventCount {
+public:
+    EventCount() : waiters(0), epoch(0) {}
+
+    unsigned int prepare_wait() {
+        // paired with the fence in notify(): either it sees us waiting, or
+        // our second look at the condition sees its change
+        waiters.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return epoch.load();
+    }
+
+    void cancel_wait() {
+        waiters.fetch_sub(1);
+    }
+
+    void wait(unsigned int key) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (epoch.load(std::memory_order_relaxed) == key)
+                cond.wait(lock);
+        }
+        waiters.fetch_sub(1);
+    }
+
+    void notify() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!waiters.load(std::memory_order_relaxed))
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            epoch.fetch_add(1, std::memory_order_relaxed);
+        }
+        cond.notify_all();
+    }
+
+private:
+    // non-copyable
+    EventCount(const EventCount &);
+    EventCount &operator=(const EventCount &);
+
+    std::atomic<int> waiters;
+    std::atomic<unsigned int> epoch; // changed under the mutex
+    std::mutex mutex;
+    std::condition_variable cond;
+};
+
+
+// One thread pushes and one thread pops.
+template <class T>
+class SpscQueue {
+    enum { CACHE_LINE = 64 };
+
+public:
+    // capacity must be a power of two
+    explicit SpscQueue(int capacity) :
+        mask(capacity - 1),
+        slots(new T[capacity]),
+        head(0),
+        tail_cache(0),
+        tail(0),
+        head_cache(0)
+    {
+        assert(capacity > 0 && !(capacity & (capacity - 1)));
+    }
+
+    ~SpscQueue() {
+        delete[] slots;
+    }
+
+    int capacity() { return mask + 1; }
+
+    // may be out of date by the time it returns, unless called by the
+    // producer (when it can only be too large) or the consumer (too small)
+    int size() {
+        return (int)(tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire));
+    }
+
+    // producer side
+
+    bool try_push(T val) {
+        return try_push_n(&val, 1) == 1;
+    }
+
+    // push as many of the n values as there is room for, moving them out
+    // of vals. returns how many were pushed
+    int try_push_n(T *vals, int n) {
+        unsigned int t = tail.load(std::memory_order_relaxed);
+        int room = capacity() - (int)(t - head_cache);
+        if (room < n) {
+            head_cache = head.load(std::memory_order_acquire);
+            room = capacity() - (int)(t - head_cache);
+        }
+        if (n > room)
+            n = room;
+        if (n <= 0)
+            return 0;
+        for (int i = 0; i < n; ++i)
+            slots[(t + i) & mask] = std::move(vals[i]);
+        tail.store(t + n, std::memory_order_release);
+        not_empty.notify();
+        return n;
+    }
+
+    // waits while the queue is full
+    void push(T val) {
+        push_n(&val, 1);
+    }
+
+    void push_n(T *vals, int n) {
+        while (n > 0) {
+            int pushed = try_push_n(vals, n);
+            vals += pushed;
+            n -= pushed;
+            if (n > 0 && !pushed) {
+                unsigned int key = not_full.prepare_wait();
+                if (size() < capacity())
+                    not_full.cancel_wait();
+                else
+                    not_full.wait(key);
+            }
+        }
+    }
+
+    // consumer side
+
+    bool try_pop(T &out) {
+        return try_pop_n(&out, 1) == 1;
+    }
+
+    // pop up to max values into out. returns how many were popped
+    int try_pop_n(T *out, int max) {
+        unsigned int h = head.load(std::memory_order_relaxed);
+        int avail = (int)(tail_cache - h);
+        if (avail < max) {
+            tail_cache = tail.load(std::memory_order_acquire);
+            avail = (int)(tail_cache - h);
+        }
+        if (max > avail)
+            max = avail;
+        if (max <= 0)
+            return 0;
+        for (int i = 0; i < max; ++i)
+            out[i] = std::move(slots[(h + i) & mask]);
+        head.store(h + max, std::memory_order_release);
+        not_full.notify();
+        return max;
+    }
+
+    // waits while the queue is empty
+    void pop(T &out) {
+        pop_n(&out, 1);
+    }
+
+    // waits until there is something to pop, then pops up to max values
+    int pop_n(T *out, int max) {
+        for (;;) {
+            int popped = try_pop_n(out, max);
+            if (popped)
+                return popped;
+            unsigned int key = not_empty.prepare_wait();
+            if (size() > 0)
+                not_empty.cancel_wait();
+            else
+                not_empty.wait(key);
+        }
+    }
+
+private:
+    // non-copyable
+    SpscQueue(const SpscQueue &);
+    SpscQueue &operator=(const SpscQueue &);
+
+    const unsigned int mask;
+    T *const slots;
+
+    char pad0[CACHE_LINE];
+    std::atomic<unsigned int> head; // written by the consumer
+    unsigned int tail_cache; // the consumer's last look at tail
+
+    char pad1[CACHE_LINE];
+    std::atomic<unsigned int> tail; // written by the producer
+    unsigned int head_cache; // the producer's last look at head
+
+    char pad2[CACHE_LINE];
+    EventCount not_empty; // the consumer sleeps here
+    EventCount not_full; // the producer sleeps here
+};
+
+
+// Any number of threads push and one thread pops. Each slot has a sequence
+// number which tells whose turn it is: a producer claims a position by
+// moving tail past it, writes the slot and then bumps its sequence number
+// to hand it to the consumer, which bumps it again to hand it back.
+template <class T>
+class MpscQueue {
+    enum { CACHE_LINE = 64 };
+
+    struct Cell {
+        std::atomic<unsigned int> seq; // position when free, position + 1 when full
+        T value;
+    };
+
+public:
+    // capacity must be a power of two
+    explicit MpscQueue(int capacity) :
+        mask(capacity - 1),
+        cells(new Cell[capacity]),
+        head(0),
+        tail(0)
+    {
+        assert(capacity > 0 && !(capacity & (capacity - 1)));
+        for (int i = 0; i < capacity; ++i)
+            cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    ~MpscQueue() {
+        delete[] cells;
+    }
+
+    int capacity() { return mask + 1; }
+
+    // producer side
+
+    bool try_push(T val) {
+        return try_push_n(&val, 1) == 1;
+    }
+
+    // push as many of the n values as there is room for, moving them out of
+    // vals. the pushed ones are adjacent in the queue. returns how many
+    // were pushed
+    int try_push_n(T *vals, int n) {
+        if (n > capacity())
+            n = capacity();
+        unsigned int t = tail.load(std::memory_order_relaxed);
+        for (;;) {
+            // the consumer frees slots in order, so if the last one we
+            // want is free for this round, so are those before it
+            while (n > 0) {
+                unsigned int last = t + n - 1;
+                if ((int)(cells[last & mask].seq.load(std::memory_order_acquire) - last) >= 0)
+                    break;
+                --n;
+            }
+            if (n <= 0)
+                return 0;
+            if (tail.compare_exchange_weak(t, t + n, std::memory_order_relaxed))
+                break;
+            // someone else got there first. t has been reloaded
+        }
+        for (int i = 0; i < n; ++i) {
+            Cell &c = cells[(t + i) & mask];
+            c.value = std::move(vals[i]);
+            c.seq.store(t + i + 1, std::memory_order_release);
+        }
+        not_empty.notify();
+        return n;
+    }
+
+    // waits while the queue is full
+    void push(T val) {
+        push_n(&val, 1);
+    }
+
+    // the values may end up apart, when the queue fills up in between
+    void push_n(T *vals, int n) {
+        while (n > 0) {
+            int pushed = try_push_n(vals, n);
+            vals += pushed;
+            n -= pushed;
+            if (n > 0 && !pushed) {
+                unsigned int key = not_full.prepare_wait();
+                if (has_room())
+                    not_full.cancel_wait();
+                else
+                    not_full.wait(key);
+            }
+        }
+    }
+
+    // consumer side
+
+    bool try_pop(T &out) {
+        return try_pop_n(&out, 1) == 1;
+    }
+
+    // pop up to max values into out. returns how many were popped. stops
+    // early at a slot that has been claimed but not written yet
+    int try_pop_n(T *out, int max) {
+        unsigned int h = head.load(std::memory_order_relaxed);
+        int n = 0;
+        while (n < max) {
+            Cell &c = cells[(h + n) & mask];
+            if (c.seq.load(std::memory_order_acquire) != h + n + 1)
+                break;
+            out[n] = std::move(c.value);
+            c.seq.store(h + n + mask + 1, std::memory_order_release);
+            ++n;
+        }
+        if (!n)
+            return 0;
+        head.store(h + n, std::memory_order_relaxed);
+        not_full.notify();
+        return n;
+    }
+
+    // waits while the queue is empty
+    void pop(T &out) {
+        pop_n(&out, 1);
+    }
+
+    // waits until there is something to pop, then pops up to max values
+    int pop_n(T *out, int max) {
+        for (;;) {
+            int popped = try_pop_n(out, max);
+            if (popped)
+                return popped;
+            unsigned int key = not_empty.prepare_wait();
+            if (has_item())
+                not_empty.cancel_wait();
+            else
+                not_empty.wait(key);
+        }
+    }
+
+private:
+    // non-copyable
+    MpscQueue(const MpscQueue &);
+    MpscQueue &operator=(const MpscQueue &);
+
+    bool has_item() {
+        unsigned int h = head.load(std::memory_order_relaxed);
+        return cells[h & mask].seq.load(std::memory_order_acquire) == h + 1;
+    }
+
+    bool has_room() {
+        unsigned int t = tail.load(std::memory_order_relaxed);
+        return (int)(cells[t & mask].seq.load(std::memory_order_acquire) - t) >= 0;
+    }
+
+    const unsigned int mask;
+    Cell *const cells;
+
+    char pad0[CACHE_LINE];
+    std::atomic<unsigned int> head; // written by the consumer
+
+    char pad1[CACHE_LINE];
+    std::atomic<unsigned int> tail; // claimed by producers
+
+    char pad2[CACHE_LINE];
+    EventCount not_empty; // the consumer sleeps here
+    EventCount not_full; // producers sleep here
+};
+
+#endif
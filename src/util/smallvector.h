@@ -0,0 +1,139 @@
+#ifndef SMALLVECTOR_H
+#define SMALLVECTOR_H
+
+#include <cassert>
+#include <new>
+#include <utility>
+#include <type_traits>
+
+// A vector which keeps up to N elements inline, and moves them to the heap
+// when it grows past that. For lists that are usually short, so that they
+// don't need an allocation of their own. Shrinking never moves them back,
+// but the heap buffer is kept to be reused.
+template <class T, int N>
+class SmallVector {
+public:
+    typedef T value_type;
+    typedef T *iterator;
+    typedef const T *const_iterator;
+
+    SmallVector() : elems((T *)inline_storage), count(0), cap(N) {}
+
+    ~SmallVector() {
+        clear();
+        release();
+    }
+
+    SmallVector(const SmallVector &v) : elems((T *)inline_storage), count(0), cap(N) {
+        reserve(v.count);
+        for (int i = 0; i < v.count; ++i)
+            push_back(v[i]);
+    }
+
+    // takes over v's heap buffer if it has one. spelled out since VS2013
+    // does not generate move constructors
+    SmallVector(SmallVector &&v) : elems((T *)inline_storage), count(0), cap(N) {
+        if (!v.is_inline()) {
+            elems = v.elems;
+            count = v.count;
+            cap = v.cap;
+            v.elems = (T *)v.inline_storage;
+            v.count = 0;
+            v.cap = N;
+            return;
+        }
+        for (int i = 0; i < v.count; ++i)
+            push_back(std::move(v[i]));
+        v.clear();
+    }
+
+    SmallVector &operator=(const SmallVector &v) {
+        if (this != &v) {
+            clear();
+            reserve(v.count);
+            for (int i = 0; i < v.count; ++i)
+                push_back(v[i]);
+        }
+        return *this;
+    }
+
+    void push_back(const T &val) {
+        if (count == cap) {
+            T copy(val); // val may live in the buffer being replaced
+            grow(cap * 2);
+            new (elems + count)T(std::move(copy));
+        } else {
+            new (elems + count)T(val);
+        }
+        ++count;
+    }
+
+    void push_back(T &&val) {
+        if (count == cap) {
+            T moved(std::move(val));
+            grow(cap * 2);
+            new (elems + count)T(std::move(moved));
+        } else {
+            new (elems + count)T(std::move(val));
+        }
+        ++count;
+    }
+
+    void pop_back() {
+        assert(count > 0);
+        elems[--count].~T();
+    }
+
+    void clear() {
+        while (count)
+            elems[--count].~T();
+    }
+
+    // make room for n elements in total
+    void reserve(int n) {
+        if (n > cap)
+            grow(n);
+    }
+
+    int size() const { return count; }
+    int capacity() const { return cap; }
+    bool empty() const { return count == 0; }
+
+    // whether the elements are still stored in the vector itself
+    bool is_inline() const { return elems == (const T *)inline_storage; }
+
+    T &operator[](int i) { assert(i >= 0 && i < count); return elems[i]; }
+    const T &operator[](int i) const { assert(i >= 0 && i < count); return elems[i]; }
+
+    T &back() { assert(count > 0); return elems[count - 1]; }
+    const T &back() const { assert(count > 0); return elems[count - 1]; }
+
+    iterator begin() { return elems; }
+    iterator end() { return elems + count; }
+    const_iterator begin() const { return elems; }
+    const_iterator end() const { return elems + count; }
+
+private:
+    void grow(int new_cap) {
+        T *e = (T *)::operator new(sizeof(T) * new_cap);
+        for (int i = 0; i < count; ++i) {
+            new (e + i)T(std::move(elems[i]));
+            elems[i].~T();
+        }
+        release();
+        elems = e;
+        cap = new_cap;
+    }
+
+    void release() {
+        if (!is_inline())
+            ::operator delete(elems);
+    }
+
+    T *elems; // inline_storage, or a heap buffer once grown
+    int count;
+    int cap;
+    typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type inline_storage[N];
+};
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <utility>
+#include <cassert>
+
+// A fixed set of worker threads running submitted tasks. Tasks are tracked
+// per Group, and wait() runs queued tasks on the calling thread until the
+// group is done, so a task may itself submit to and wait on the pool
+// without deadlocking it.
+class ThreadPool {
+public:
+    class Group {
+    public:
+        Group() : pending(0) {}
+        ~Group() { assert(pending == 0); }
+
+    private:
+        friend class ThreadPool;
+        int pending; // protected by the pool mutex
+    };
+
+    // num_threads < 0 picks one less than the number of cores, since the
+    // thread calling wait() does work as well
+    explicit ThreadPool(int num_threads = -1) : head(0), quit(false) {
+        if (num_threads < 0) {
+            num_threads = (int)std::thread::hardware_concurrency() - 1;
+            if (num_threads < 1)
+                num_threads = 1;
+        }
+        for (int i = 0; i < num_threads; ++i)
+            threads.push_back(std::thread([this]() { worker(); }));
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        cond.notify_all();
+        for (std::thread &t : threads)
+            t.join();
+        assert(head == tasks.size());
+    }
+
+    int size() { return (int)threads.size(); }
+
+    void submit(Group &g, std::function<void()> func) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++g.pending;
+            Task task = { std::move(func), &g };
+            tasks.push_back(std::move(task));
+        }
+        cond.notify_one();
+    }
+
+    // block until all tasks submitted to g have finished, running queued
+    // tasks (of any group) in the meantime
+    void wait(Group &g) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (g.pending > 0) {
+            if (head == tasks.size()) {
+                cond.wait(lock);
+                continue;
+            }
+            run_one(lock);
+        }
+    }
+
+private:
+    struct Task {
+        std::function<void()> func;
+        Group *group;
+    };
+
+    void worker() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            if (head < tasks.size())
+                run_one(lock);
+            else if (quit)
+                return;
+            else
+                cond.wait(lock);
+        }
+    }
+
+    // called with the lock held, which is released while the task runs
+    void run_one(std::unique_lock<std::mutex> &lock) {
+        Task task = std::move(tasks[head++]);
+        if (head == tasks.size()) {
+            // start over, keeping the capacity
+            tasks.clear();
+            head = 0;
+        }
+        lock.unlock();
+        task.func();
+        lock.lock();
+        if (--task.group->pending == 0)
+            cond.notify_all(); // wake whoever waits for the group
+    }
+
+    std::vector<std::thread> threads;
+    std::vector<Task> tasks; // queued from head on
+    size_t head;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool quit;
+};
+
+#endif